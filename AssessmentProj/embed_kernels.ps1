@@ -0,0 +1,29 @@
+# Writes the bytes of an opencl source file into a C++ header as a null terminated char array,
+# so that the kernels are compiled into the executable instead of being read at runtime.
+# The source's 64-bit FNV-1a hash is written along with it, for keying the program binary cache,
+# so that the compiler doesn't have to evaluate it.
+# The source is expected to be ASCII, since bytes above 0x7f don't fit a signed char initializer.
+param([string]$Source, [string]$Header)
+
+$bytes = [System.IO.File]::ReadAllBytes($Source)
+$name = [System.IO.Path]::GetFileName($Source)
+
+$rows = for ($i = 0; $i -lt $bytes.Length; $i += 16) {
+	$last = [Math]::Min($i + 16, $bytes.Length) - 1
+	"`t" + (($bytes[$i..$last] | ForEach-Object { '0x{0:x2},' -f $_ }) -join ' ')
+}
+
+# UInt64 arithmetic can't wrap in powershell, so the hash is kept modulo 2^64 in a BigInteger. The
+# bytes only change its low byte when xored in.
+Add-Type -AssemblyName System.Numerics
+$hash = [System.Numerics.BigInteger]::Parse('14695981039346656037')
+$prime = [System.Numerics.BigInteger]1099511628211
+$modulus = [System.Numerics.BigInteger]::Pow(2, 64)
+foreach ($byte in $bytes) {
+	$low = [int]($hash % 256)
+	$hash = (($hash - $low + ($low -bxor $byte)) * $prime) % $modulus
+}
+
+$lines = @("// generated from $name by embed_kernels.ps1, do not edit", '#pragma once', '', 'constexpr char kernel_source[] = {') + $rows + @("`t0x00", '};', '', "constexpr unsigned long long kernel_source_hash = $($hash)ull;")
+New-Item -ItemType Directory -Force -Path ([System.IO.Path]::GetDirectoryName($Header)) | Out-Null
+Set-Content -Path $Header -Encoding ASCII -Value $lines
@@ -1,214 +1,504 @@
+// The kernels are written once and specialized by the host at build time with:
+//   PIXEL        the pixel type (uchar or ushort)
+//   PIXEL_MAX    the largest value a pixel can hold (255 or 65535)
+//   BINS         the number of histogram bins (PIXEL_MAX + 1)
+//   CHANNELS     the number of channels of the input image (1 for greyscale, 3 for RGB)
+//   HIST_COPIES  how many replicated histograms hist_local keeps in local memory (0 if none fit)
+//   FIXED_POINT_COLOR  1 to do the 8-bit RGB/CMYK conversions in integer arithmetic, 0 for float
+//   LOCAL_LUT    1 if the lookup table fits in local memory, 0 otherwise
+//   INTERLEAVED  1 if RGB images are packed pixel by pixel as in a ppm file, 0 if planar as CImg stores them
+//   LARGE_IMAGES 1 to index pixels and count histogram bins in 64 bits, 0 for 32 bits
+
+#define CAT(a, b) a##b
+#define VECTOR(type, n) CAT(type, n)
+#define PIXEL16 VECTOR(PIXEL, 16)
+
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+// pixels are indexed by INDEX and the histogram and its scan are counted in COUNT. Images of 2^31 values
+// or more need the 64-bit types, which are slower on most devices, so the 32-bit ones are used otherwise.
+#if LARGE_IMAGES
+typedef long INDEX;
+typedef ulong COUNT;
+#else
+typedef int INDEX;
+typedef uint COUNT;
+#endif
+
+// adds a work-group's count to a global bin. 64-bit atomics are optional, so without them a 64-bit bin is
+// updated as two words: the low word is added to and, if that wraps around, the carry goes to the high one.
+// The two are only read once the kernel is done, when they are consistent.
+#if LARGE_IMAGES && defined(cl_khr_int64_base_atomics)
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+
+void count_add(global COUNT* bin, const uint value) {
+	atom_add(bin, (COUNT)value);
+}
+#elif LARGE_IMAGES
+void count_add(global COUNT* bin, const uint value) {
+	global uint* words = (global uint*)bin;
+#ifdef __ENDIAN_LITTLE__
+	global uint* low = words, * high = words + 1;
+#else
+	global uint* low = words + 1, * high = words;
+#endif
+
+	if (atomic_add(low, value) > UINT_MAX - value)
+		atomic_inc(high);
+}
+#else
+void count_add(global COUNT* bin, const uint value) {
+	atomic_add(bin, value);
+}
+#endif
+
 float calculate_cmyk_band(float color, float k) {
-	return (1. - color - k) / (1. - k);	
+	return (1. - color - k) / (1. - k);
 }
 
 float insure_cmyk_range(float color) {
 	return fmax(0, fmin(1, color));
 }
 
-kernel void uchar_rgb_to_cmyk(global const uchar* in, global uchar* out) {
-	int size = get_global_size(0);
-	int gid = get_global_id(0);
-	int channel_size = size / 3;
-	
-	if (gid > size / 3)
-		return;
-	
-	float r = ((float)in[gid]) / 255.;
-	float g = ((float)in[gid + channel_size]) / 255.;
-	float b = ((float)in[gid + channel_size * 2]) / 255.;
-	
-	float k = 1. - fmax(r, fmax(g, b));
-	float c = insure_cmyk_range(calculate_cmyk_band(r, k));
-	float m = insure_cmyk_range(calculate_cmyk_band(g, k));
-	float y = insure_cmyk_range(calculate_cmyk_band(b, k));
-	k = insure_cmyk_range(k);
-
-	out[gid] = (uchar)(c * 255.);
-	out[gid + channel_size] = (uchar)(m * 255.);
-	out[gid + channel_size * 2] = (uchar)(y * 255.);
-	out[gid + channel_size * 3] = (uchar)(k * 255.);
-}
-
-kernel void ushort_rgb_to_cmyk(global const ushort* in, global ushort* out) {
-	int size = get_global_size(0);
-	int gid = get_global_id(0);
-	int channel_size = size / 3;
-	
-	if (gid > size / 3)
-		return;
-	
-	float r = ((float)in[gid]) / 255.;
-	float g = ((float)in[gid + channel_size]) / 255.;
-	float b = ((float)in[gid + channel_size * 2]) / 255.;
-	
-	float k = 1. - fmax(r, fmax(g, b));
-	float c = insure_cmyk_range(calculate_cmyk_band(r, k));
-	float m = insure_cmyk_range(calculate_cmyk_band(g, k));
-	float y = insure_cmyk_range(calculate_cmyk_band(b, k));
-	k = insure_cmyk_range(k);
-
-	out[gid] = (ushort)(c * 255.);
-	out[gid + channel_size] = (ushort)(m * 255.);
-	out[gid + channel_size * 2] = (ushort)(y * 255.);
-	out[gid + channel_size * 3] = (ushort)(k * 255.);
-}
-
-kernel void uchar_hist(global const uchar* in, global uint* hist, local uint* local_hist, const ulong bins) {
-	int gid = get_global_id(0);
-	int gsize = get_global_size(0);
-	int lid = get_local_id(0);
-	int lsize = get_global_size(0);
-	
-	if (lid < bins)
-		local_hist[lid] = 0;
+float calculate_k(float r, float g, float b) {
+	return 1. - fmax(r, fmax(g, b));
+}
 
-	barrier(CLK_LOCAL_MEM_FENCE);
-	
-	if (gid < gsize)
-		atomic_inc(&local_hist[in[gid]]);
+float calculate_rgb_band(float color, float k) {
+	return (1. - color) * (1. - k);
+}
 
-	barrier(CLK_LOCAL_MEM_FENCE);
+float insure_rgb_range(float color) {
+	return fmax(0, fmin(1, color));
+}
 
-	if (lid < bins)
-		atomic_add(&hist[lid], local_hist[lid]);
+// float_k gives the quantized K of an RGB pixel, and float_rgb converts the pixel to CMYK, replaces its K
+// with k and converts it back to RGB. C, M and Y are quantized exactly as a CMYK image of PIXELs would
+// have stored them.
+PIXEL float_k(const PIXEL* rgb) {
+	float k = calculate_k(
+		((float)rgb[0]) / PIXEL_MAX,
+		((float)rgb[1]) / PIXEL_MAX,
+		((float)rgb[2]) / PIXEL_MAX
+	);
+	return (PIXEL)(insure_cmyk_range(k) * PIXEL_MAX);
 }
 
-kernel void ushort_hist(global const ushort* in, global uint* hist, local uint* local_hist, const ulong bins) {
-	int gid = get_global_id(0);
-	int gsize = get_global_size(0);
+void float_rgb(const PIXEL* rgb, const PIXEL k, PIXEL* out) {
+	float original_k = calculate_k(
+		((float)rgb[0]) / PIXEL_MAX,
+		((float)rgb[1]) / PIXEL_MAX,
+		((float)rgb[2]) / PIXEL_MAX
+	);
+	float new_k = ((float)k) / PIXEL_MAX;
 
-	if (gid < gsize) {
-		atomic_inc(&hist[in[gid]]);
+	for (int i = 0; i < 3; ++i) {
+		float color = ((float)rgb[i]) / PIXEL_MAX;
+		float band = (PIXEL)(insure_cmyk_range(calculate_cmyk_band(color, original_k)) * PIXEL_MAX) / (float)PIXEL_MAX;
+		out[i] = (PIXEL)(insure_rgb_range(calculate_rgb_band(band, new_k)) * PIXEL_MAX);
 	}
+}
 
+#if FIXED_POINT_COLOR
+// 8-bit pixels only have 256 levels, so the same conversion can be done in integers: K is 255 - max,
+// a C/M/Y band is 255 * (max - color) / max and an RGB band is (255 - band) * (255 - K) / 255.
+// Division by max goes through a table of 2^24 / max + 1, which is exact for numerators up to 255 * 255.
+#define RECIPROCAL(d) ((d)? (1u << 24) / (d) + 1 : 0)
+#define RECIPROCAL4(d) RECIPROCAL(d), RECIPROCAL(d + 1), RECIPROCAL(d + 2), RECIPROCAL(d + 3)
+#define RECIPROCAL16(d) RECIPROCAL4(d), RECIPROCAL4(d + 4), RECIPROCAL4(d + 8), RECIPROCAL4(d + 12)
+#define RECIPROCAL64(d) RECIPROCAL16(d), RECIPROCAL16(d + 16), RECIPROCAL16(d + 32), RECIPROCAL16(d + 48)
+
+constant uint reciprocals[256] = {RECIPROCAL64(0), RECIPROCAL64(64), RECIPROCAL64(128), RECIPROCAL64(192)};
+
+// x / 255 for any x below 65535, without a division
+uint divide_255(const uint x) {
+	return (x + 1 + (x >> 8)) >> 8;
 }
 
-int blelloch_r(const int gid, const int stride) {
-	return (gid + 1) % (stride * 2);
+uchar fixed_k(const uchar* rgb) {
+	return 255 - max(rgb[0], max(rgb[1], rgb[2]));
 }
 
-kernel void uchar_cdf(global uint* in, global uchar* out, const ulong pixels, ulong bins) {
-	int gid = get_global_id(0);
-	int gsize = get_global_size(0);
-	int temp, relative_gid;
+void fixed_rgb(const uchar* rgb, const uchar k, uchar* out) {
+	uint peak = max(rgb[0], max(rgb[1], rgb[2]));
 
-	for (int stride = 1; stride < gsize; stride *= 2) {
-		if (!blelloch_r(gid, stride)) in[gid] += in[gid - stride];
-		barrier(CLK_GLOBAL_MEM_FENCE);
+	for (int i = 0; i < 3; ++i) {
+		// a black pixel has no defined band, which the float version clamps to 1
+		uint band = (peak)? (uint)(((ulong)(peak - rgb[i]) * 255 * reciprocals[peak]) >> 24) : 255;
+		out[i] = divide_255((255 - band) * (255 - k));
 	}
+}
 
-	if (!gid) in[gsize-1] = 0;
-	barrier(CLK_GLOBAL_MEM_FENCE);
-	for (int stride = gsize/2; stride > 0; stride /= 2) {
-		if (!blelloch_r(gid, stride)) {
-			relative_gid = gid - stride;
-			temp = in[gid];
-			in[gid] += in[relative_gid];
-			in[relative_gid] = temp;
-		}
-		barrier(CLK_GLOBAL_MEM_FENCE);
+#define color_k fixed_k
+#define color_rgb fixed_rgb
+#else
+#define color_k float_k
+#define color_rgb float_rgb
+#endif
+
+// where channel c of pixel i is in an RGB image, and in a block of 16 of its pixels read as three PIXEL16s
+#if INTERLEAVED
+#define RGB_INDEX(i, c, pixels) ((i) * 3 + (c))
+#define BLOCK_INDEX(j, c) ((j) * 3 + (c))
+#else
+#define RGB_INDEX(i, c, pixels) ((i) + (pixels) * (c))
+#define BLOCK_INDEX(j, c) ((c) * 16 + (j))
+#endif
+
+// the value that is histogrammed for pixel i. In RGB mode only the K channel is histogrammed, so it is
+// computed on the fly from the RGB input rather than materialising a CMYK image first.
+PIXEL hist_value(global const PIXEL* in, const INDEX i, const INDEX pixels) {
+#if CHANNELS == 3
+	PIXEL rgb[3] = {in[RGB_INDEX(i, 0, pixels)], in[RGB_INDEX(i, 1, pixels)], in[RGB_INDEX(i, 2, pixels)]};
+
+	return color_k(rgb);
+#else
+	return in[i];
+#endif
+}
+
+// each work-item strides over the image rather than taking one pixel. The work-group keeps HIST_COPIES
+// copies of the histogram in local memory (padded by one bin so the copies fall in different banks) and
+// neighbouring work-items update different copies, so that the few hot bins of low contrast images
+// don't serialize on one local atomic. The copies are summed once before flushing to global memory.
+// The host launches enough work-groups that none of them counts 2^31 pixels, so the local copies can stay
+// 32-bit even for large images.
+#if HIST_COPIES
+kernel void hist_local(global const PIXEL* in, global COUNT* hist, local uint* local_hist, const ulong pixels) {
+	INDEX gid = get_global_id(0);
+	INDEX gsize = get_global_size(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int stride = BINS + 1;
+	INDEX first = 0;
+	local uint* copy_hist = local_hist + (lid % HIST_COPIES) * stride;
+
+	for (int i = lid; i < HIST_COPIES * stride; i += lsize)
+		local_hist[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+#if CHANNELS == 1
+	// greyscale pixels are read 16 at a time, leaving the remainder to the loop below
+	INDEX vectors = pixels / 16;
+
+	for (INDEX i = gid; i < vectors; i += gsize) {
+		PIXEL16 vector = vload16(i, in);
+		const PIXEL* values = (const PIXEL*)&vector;
+
+		for (int j = 0; j < 16; ++j)
+			atomic_inc(&copy_hist[values[j]]);
 	}
 
-	bins--;
-	out[gid] = (uchar)round(
-		((float)in[gid] - (float)in[0]) * bins
-		/ ((float)in[bins] - (float)in[0])
-	);
+	first = vectors * 16;
+#endif
+
+	for (INDEX i = first + gid; i < pixels; i += gsize)
+		atomic_inc(&copy_hist[hist_value(in, i, pixels)]);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int bin = lid; bin < BINS; bin += lsize) {
+		uint total = 0;
+
+		for (int copy = 0; copy < HIST_COPIES; ++copy)
+			total += local_hist[copy * stride + bin];
+
+		if (total)
+			count_add(&hist[bin], total);
+	}
 }
+#endif
 
-kernel void ushort_cdf(global uint* in, global ushort* out, const ulong pixels, ulong bins) {
+// when the histogram does not fit in local memory (65536 bins) each work-group is given its own slice
+// of a global scratch buffer (groups * BINS) instead, so it only contends with its own work-items.
+kernel void hist_global(global const PIXEL* in, global uint* partial_hist, const ulong pixels) {
+	INDEX gid = get_global_id(0);
+	INDEX gsize = get_global_size(0);
+	global uint* group_hist = partial_hist + get_group_id(0) * BINS;
+
+	for (INDEX i = gid; i < pixels; i += gsize)
+		atomic_inc(&group_hist[hist_value(in, i, pixels)]);
+}
+
+// the partial histograms are then summed bin by bin, one work-item per bin, and added to the histogram
+// so that an image counted in stripes accumulates into one.
+kernel void hist_merge(global const uint* partial_hist, global COUNT* hist, const ulong groups) {
 	int gid = get_global_id(0);
-	int gsize = get_global_size(0);
-	int temp, relative_gid;
+	COUNT total = 0;
 
-	for (int stride = 1; stride < gsize; stride *= 2) {
-		if (!blelloch_r(gid, stride)) in[gid] += in[gid - stride];
-		barrier(CLK_GLOBAL_MEM_FENCE);
-	}
+	if (gid >= BINS)
+		return;
+
+	for (int group = 0; group < groups; ++group)
+		total += partial_hist[group * BINS + gid];
+
+	hist[gid] += total;
+}
 
-	if (!gid) in[gsize-1] = 0;
-	barrier(CLK_GLOBAL_MEM_FENCE);
+// exclusive prefix sum of one value per work-item across its work-group. Every work-item of the group
+// must call it, and scratch must hold at least get_local_size(0) + 1 values. The sum of the whole group
+// is written to total, and the scratch space can be reused as soon as it returns.
+#ifdef cl_khr_subgroups
+// with sub-groups, each sub-group scans in registers and only the sub-group totals go through local
+// memory. There are few of them, so a single work-item scans those serially.
+COUNT local_scan(local COUNT* scratch, const COUNT value, COUNT* total) {
+	int sub_group = get_sub_group_id();
+	int sub_groups = get_num_sub_groups();
+	COUNT offset = sub_group_scan_exclusive_add(value);
 
-	for (int stride = gsize/2; stride > 0; stride /= 2) {
-		if (!blelloch_r(gid, stride)) {
-			relative_gid = gid - stride;
-			temp = in[gid];
-			in[gid] += in[relative_gid];
-			in[relative_gid] = temp;
+	if (get_sub_group_local_id() == get_sub_group_size() - 1)
+		scratch[sub_group] = offset + value;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (!get_local_id(0)) {
+		COUNT running = 0, count;
+
+		for (int i = 0; i < sub_groups; ++i) {
+			count = scratch[i];
+			scratch[i] = running;
+			running += count;
 		}
-		barrier(CLK_GLOBAL_MEM_FENCE);
+		scratch[sub_groups] = running;
 	}
 
-	bins--;
-	out[gid] = (ushort)round(
-		((float)in[gid] - (float)in[0]) * bins
-		/ ((float)in[bins] - (float)in[0])
-	);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	*total = scratch[sub_groups];
+	offset += scratch[sub_group];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return offset;
 }
+#else
+// otherwise a Hillis-Steele scan is done in local memory
+COUNT local_scan(local COUNT* scratch, const COUNT value, COUNT* total) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	COUNT inclusive;
+
+	scratch[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int offset = 1; offset < lsize; offset *= 2) {
+		COUNT neighbour = (lid >= offset)? scratch[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += neighbour;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
 
-kernel void uchar_cdf_lookup(global uchar* light_vals, global const uchar* cdf) {
+	*total = scratch[lsize - 1];
+	inclusive = scratch[lid];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return inclusive - value;
+}
+#endif
+
+// barriers only synchronize a single work-group, so the device-wide scan is done as reduce-then-scan
+// over three launches. First every work-group sums its block of the input...
+kernel void scan_reduce(global const COUNT* in, global COUNT* block_sums, local COUNT* scratch, const ulong n) {
 	int gid = get_global_id(0);
-	int gsize = get_global_size(0);
+	COUNT total;
+
+	local_scan(scratch, (gid < n)? in[gid] : 0, &total);
+
+	if (!get_local_id(0))
+		block_sums[get_group_id(0)] = total;
+}
+
+// ...then a single work-group scans the block sums in chunks, carrying the running total between them,
+// so that any number of blocks is supported...
+kernel void scan_block_sums(global COUNT* block_sums, local COUNT* scratch, const ulong blocks) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	COUNT carry = 0, total, offset;
+
+	for (int base = 0; base < blocks; base += lsize) {
+		int i = base + lid;
+		offset = local_scan(scratch, (i < blocks)? block_sums[i] : 0, &total);
 
-	light_vals[gid] = cdf[light_vals[gid]];
+		if (i < blocks)
+			block_sums[i] = carry + offset;
+
+		carry += total;
+	}
 }
 
-kernel void ushort_cdf_lookup(global ushort* light_vals, global const ushort* cdf) {
+// ...and finally every work-group scans its block again, offset by the scanned sum of the blocks before it.
+kernel void scan_blocks(global COUNT* data, global const COUNT* block_sums, local COUNT* scratch, const ulong n) {
 	int gid = get_global_id(0);
-	int gsize = get_global_size(0);
+	COUNT total, offset;
 
-	light_vals[gid] = cdf[light_vals[gid]];
+	offset = local_scan(scratch, (gid < n)? data[gid] : 0, &total);
+
+	if (gid < n)
+		data[gid] = block_sums[get_group_id(0)] + offset;
 }
 
-float calculate_rgb_band(float color, float k) {
-	return (1. - color) * (1. - k);
+// the exclusive scan of the histogram is stretched over the full range of bins to make the lookup table
+PIXEL normalise(const COUNT value, const COUNT first, const float range) {
+	return (PIXEL)round(((float)value - (float)first) * (BINS - 1) / fmax(range, 1.f));
 }
 
-float insure_rgb_range(float color) {
-	return fmax(0, fmin(1, color));
+// when the whole histogram fits in local memory (8-bit images) one work-group loads it, scans it and
+// writes the normalised lookup table in a single launch. Each work-item scans a contiguous chunk of
+// bins, starting from the scanned sum of the chunks before it.
+kernel void cdf_local(global const COUNT* hist, global PIXEL* out, local COUNT* local_cdf, local COUNT* scratch) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int chunk = (BINS + lsize - 1) / lsize;
+	int begin = min(lid * chunk, BINS);
+	int end = min(begin + chunk, BINS);
+	COUNT sum = 0, total, running, count;
+	float range;
+
+	for (int i = lid; i < BINS; i += lsize)
+		local_cdf[i] = hist[i];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = begin; i < end; ++i)
+		sum += local_cdf[i];
+
+	running = local_scan(scratch, sum, &total);
+
+	for (int i = begin; i < end; ++i) {
+		count = local_cdf[i];
+		local_cdf[i] = running;
+		running += count;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	range = (float)local_cdf[BINS - 1] - (float)local_cdf[0];
+
+	for (int i = lid; i < BINS; i += lsize)
+		out[i] = normalise(local_cdf[i], local_cdf[0], range);
 }
 
-kernel void uchar_cmyk_to_rgb(global const uchar* in, global uchar* out) {
-	int size = get_global_size(0);
+kernel void cdf_normalise(global const COUNT* cdf, global PIXEL* out) {
 	int gid = get_global_id(0);
-	int channel_size = size / 4;
-	
-	if (gid > size / 4)
+	float range = (float)cdf[BINS - 1] - (float)cdf[0];
+
+	if (gid >= BINS)
 		return;
 
-	float c = ((float)in[gid]) / 255.;
-	float m = ((float)in[gid + channel_size]) / 255.;
-	float y = ((float)in[gid + channel_size * 2]) / 255.;
-	float k = ((float)in[gid + channel_size * 3]) / 255.;
-	
-	float r = insure_rgb_range(calculate_rgb_band(c, k));
-	float g = insure_rgb_range(calculate_rgb_band(m, k));
-	float b = insure_rgb_range(calculate_rgb_band(y, k));
+	out[gid] = normalise(cdf[gid], cdf[0], range);
+}
 
-	out[gid] = (uchar)(r * 255);
-	out[gid + channel_size] = (uchar)(g * 255);
-	out[gid + channel_size * 2] = (uchar)(b * 255);	
+// the lookup table is staged in local memory once per work-group when it fits (LOCAL_LUT), otherwise
+// it is read from global memory directly
+#if LOCAL_LUT
+#define LUT_SPACE local
+#else
+#define LUT_SPACE global
+#endif
+
+LUT_SPACE const PIXEL* stage_lut(global const PIXEL* cdf, local PIXEL* local_cdf) {
+#if LOCAL_LUT
+	for (int i = get_local_id(0); i < BINS; i += get_local_size(0))
+		local_cdf[i] = cdf[i];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return local_cdf;
+#else
+	return cdf;
+#endif
 }
 
-kernel void ushort_cmyk_to_rgb(global const ushort* in, global ushort* out) {
-	int size = get_global_size(0);
+// each work-item equalizes 16 pixels in place with one vector load and store. The work-item after the
+// last full vector takes the pixels that are left over.
+kernel void cdf_lookup(global PIXEL* light_vals, global const PIXEL* cdf, local PIXEL* local_cdf, const ulong pixels) {
+	INDEX gid = get_global_id(0);
+	INDEX vectors = pixels / 16;
+	LUT_SPACE const PIXEL* lut = stage_lut(cdf, local_cdf);
+
+	if (gid < vectors) {
+		PIXEL16 vector = vload16(gid, light_vals);
+		PIXEL* values = (PIXEL*)&vector;
+
+		for (int j = 0; j < 16; ++j)
+			values[j] = lut[values[j]];
+
+		vstore16(vector, gid, light_vals);
+	}
+	else if (gid == vectors) {
+		for (INDEX i = vectors * 16; i < pixels; ++i)
+			light_vals[i] = lut[light_vals[i]];
+	}
+}
+
+// the colour tail recomputes CMYK from the original RGB, equalizes K through the lookup table and
+// converts straight back in one pass, instead of writing a four plane CMYK image and copying its K
+// plane in and out. Like cdf_lookup, each work-item takes 16 pixels: 16 from each plane, or 48
+// consecutive values when the pixels are interleaved.
+kernel void cdf_lookup_rgb(global const PIXEL* in, global PIXEL* out, global const PIXEL* cdf, local PIXEL* local_cdf, const ulong pixels) {
+	INDEX gid = get_global_id(0);
+	INDEX vectors = pixels / 16;
+	LUT_SPACE const PIXEL* lut = stage_lut(cdf, local_cdf);
+	PIXEL rgb[3], equalized[3];
+
+	if (gid < vectors) {
+#if INTERLEAVED
+		PIXEL16 block[3] = {vload16(gid * 3, in), vload16(gid * 3 + 1, in), vload16(gid * 3 + 2, in)};
+#else
+		PIXEL16 block[3] = {vload16(gid, in), vload16(gid, in + pixels), vload16(gid, in + pixels * 2)};
+#endif
+		PIXEL* values = (PIXEL*)block;
+
+		for (int j = 0; j < 16; ++j) {
+			for (int c = 0; c < 3; ++c)
+				rgb[c] = values[BLOCK_INDEX(j, c)];
+
+			color_rgb(rgb, lut[color_k(rgb)], equalized);
+
+			for (int c = 0; c < 3; ++c)
+				values[BLOCK_INDEX(j, c)] = equalized[c];
+		}
+
+#if INTERLEAVED
+		for (int c = 0; c < 3; ++c)
+			vstore16(block[c], gid * 3 + c, out);
+#else
+		for (int c = 0; c < 3; ++c)
+			vstore16(block[c], gid, out + pixels * c);
+#endif
+	}
+	else if (gid == vectors) {
+		for (INDEX i = vectors * 16; i < pixels; ++i) {
+			for (int c = 0; c < 3; ++c)
+				rgb[c] = in[RGB_INDEX(i, c, pixels)];
+
+			color_rgb(rgb, lut[color_k(rgb)], equalized);
+
+			for (int c = 0; c < 3; ++c)
+				out[RGB_INDEX(i, c, pixels)] = equalized[c];
+		}
+	}
+}
+
+#if FIXED_POINT_COLOR
+// checks the fixed point conversion against the float one, one work-item per 24-bit RGB value. Both
+// are given the same K so that only the conversion is compared, and the largest difference of any
+// channel (K included) is kept in error.
+kernel void fixed_point_error(global uint* error) {
 	int gid = get_global_id(0);
-	int channel_size = size / 4;
-	
-	if (gid > size / 4)
-		return;
+	uchar rgb[3] = {gid & 255, (gid >> 8) & 255, (gid >> 16) & 255};
+	uchar float_out[3], fixed_out[3];
+	uchar k = float_k(rgb);
+	uint difference = abs_diff(k, fixed_k(rgb));
+
+	float_rgb(rgb, k, float_out);
+	fixed_rgb(rgb, k, fixed_out);
 
-	float c = ((float)in[gid]) / 255.;
-	float m = ((float)in[gid + channel_size]) / 255.;
-	float y = ((float)in[gid + channel_size * 2]) / 255.;
-	float k = ((float)in[gid + channel_size * 3]) / 255.;
-	
-	float r = insure_rgb_range(calculate_rgb_band(c, k));
-	float g = insure_rgb_range(calculate_rgb_band(m, k));
-	float b = insure_rgb_range(calculate_rgb_band(y, k));
+	for (int i = 0; i < 3; ++i)
+		difference = max(difference, (uint)abs_diff(float_out[i], fixed_out[i]));
 
-	out[gid] = (ushort)(r * 255);
-	out[gid + channel_size] = (ushort)(g * 255);
-	out[gid + channel_size * 2] = (ushort)(b * 255);	
+	if (difference)
+		atomic_max(error, difference);
 }
+#endif
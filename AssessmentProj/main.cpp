@@ -1,11 +1,33 @@
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
 #include <stdexcept>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <sstream>
 #include <sys/types.h>
+#ifdef _WIN32
+#define NOMINMAX
+#include <direct.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <thread>
 #include <tuple>
 #include <vector>
 
@@ -16,6 +38,9 @@
 
 #include "include/dtypes.h"
 
+// kernels.cl as a char array and its hash, generated by the build from embed_kernels.ps1
+#include "kernels.cl.h"
+
 using namespace cimg_library;
 
 template <typename T>
@@ -47,27 +72,85 @@ void print_help_message() {
 		<< "-d = print debug messages\n"
 		<< "-c <gs|rgb> = specifies whether to interpret the image as greyscale or color (defaults to greyscale)\n"
 		<< "-s <8|16> = specifies the color rate of the image (defaults to 8)\n"
-		<< "-i <filename> = specifies the input file to use\n";
+		<< "-f <float|fixed> = specifies the arithmetic of 8-bit color conversions (defaults to float, fixed is faster on cpu devices but its conversions may differ from float's by one level, which equalization can widen)\n"
+		<< "-l <planar|interleaved> = specifies the layout RGB pixels are processed in, interleaved reads and writes ppm pixels as they are (defaults to planar)\n"
+		<< "-n <1|2|3> = specifies how many images are kept in flight on the device at once (defaults to 2)\n"
+		<< "-g = indexes pixels and counts histograms in 64 bits, needed for images of 2^31 values or more\n"
+		<< "-r <rows> = streams images through the device in stripes of this many rows (defaults to only those too large for one buffer)\n"
+		<< "-i <filename> = specifies an input file to use, repeat it to process several images in turn\n"
+		<< "-b <directory|pattern|manifest> = adds every image in a directory, matching a quoted pattern or listed one per line in a file\n"
+		<< "-o <filename> = writes the output to a file instead of displaying it, numbered per image if there are several\n";
 }
 
 enum ColorMode {GRAYSCALE, RGB};
+enum ColorMath {FLOAT_MATH, FIXED_MATH};
+enum Layout {PLANAR_LAYOUT, INTERLEAVED_LAYOUT};
 
 struct Options {
-	bool debug, help_mode;
+	bool debug, help_mode, large_images;
 	size_t bits;
 	ColorMode color_mode;
-	std::string file_name;
+	ColorMath color_math;
+	Layout layout;
+	size_t in_flight, stripe_rows;
+	std::vector<std::string> file_names;
+	std::string output_file_name;
 
 	Options(): help_mode(true) {}
-	Options(bool debug, bool help_mode, size_t bits, ColorMode color_mode, std::string file_name):
-		debug(debug), help_mode(help_mode), bits(bits), color_mode(color_mode), file_name(file_name) {}
+	Options(bool debug, bool help_mode, bool large_images, size_t bits, ColorMode color_mode, ColorMath color_math, Layout layout, size_t in_flight, size_t stripe_rows, std::vector<std::string> file_names, std::string output_file_name):
+		debug(debug), help_mode(help_mode), large_images(large_images), bits(bits), color_mode(color_mode), color_math(color_math), layout(layout), in_flight(in_flight), stripe_rows(stripe_rows), file_names(file_names), output_file_name(output_file_name) {}
 };
 
+auto is_image(const std::string& file_name) -> bool {
+	// the formats CImg reads itself or through its usual libraries
+	const char* extensions[] = {"pgm", "ppm", "pnm", "pbm", "bmp", "png", "jpg", "jpeg", "tif", "tiff", "gif"};
+	const char* extension = cimg::split_filename(file_name.c_str());
+
+	for (const char* image_extension: extensions)
+		if (!cimg::strcasecmp(extension, image_extension)) return true;
+	return false;
+}
+
+auto batch_files(const std::string& batch) -> std::vector<std::string> {
+	/*
+	A batch is either a directory, all of whose images are used, a pattern such as "images/*.ppm" or a
+	manifest file listing one image per line. Other files in a directory, such as readmes and sidecar
+	files, are skipped by their extension. Blank lines and lines starting with # are skipped.
+	*/
+	std::vector<std::string> file_names;
+	cbool directory = cimg::is_directory(batch.c_str());
+
+	if (batch.find_first_of("*?") != std::string::npos || directory) {
+		const CImgList<char> files = cimg::files(batch.c_str(), true, 0, true);
+		for (u32 i = 0; i < files.size(); ++i)
+			if (!directory || is_image(files[i].data())) file_names.push_back(files[i].data());
+	}
+	else {
+		std::ifstream manifest(batch);
+		if (!manifest) throw std::invalid_argument("-b option must be a directory, a pattern or a manifest file");
+
+		std::string line;
+		while (std::getline(manifest, line)) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (!line.empty() && line.front() != '#') file_names.push_back(line);
+		}
+	}
+
+	if (file_names.empty()) throw std::invalid_argument("-b option found no images in " + batch);
+	return file_names;
+}
+
 auto handle_args(ci32& argc, str* argv, ci32& platform_id, ci32& device_id) -> Options {
 	bool debug = false;
+	bool large_images = false;
 	size_t bits = 8;
 	ColorMode color_mode = GRAYSCALE;
-	std::string file_name = "";
+	ColorMath color_math = FLOAT_MATH;
+	Layout layout = PLANAR_LAYOUT;
+	size_t in_flight = 2;
+	size_t stripe_rows = 0;
+	std::vector<std::string> file_names;
+	std::string output_file_name = "";
 	
 	for (i32 i = 0; i < argc; ++i) {
 		const std::string str_arg(argv[i]);
@@ -79,7 +162,8 @@ auto handle_args(ci32& argc, str* argv, ci32& platform_id, ci32& device_id) -> O
 		}
 		
 		if (str_arg == "-p") print_platform(platform_id, device_id);
-		if (str_arg == "-d") debug = True;
+		if (str_arg == "-d") debug = true;
+		if (str_arg == "-g") large_images = true;
 		
 		if (str_arg == "-c") {
 			if (next_arg == "gs") {}
@@ -91,14 +175,46 @@ auto handle_args(ci32& argc, str* argv, ci32& platform_id, ci32& device_id) -> O
 			else if (next_arg == "16") bits = 16;
 			else throw std::invalid_argument("-s option must be either 8 or 16");
 		}
+		if (str_arg == "-f") {
+			if (next_arg == "float") color_math = FLOAT_MATH;
+			else if (next_arg == "fixed") color_math = FIXED_MATH;
+			else throw std::invalid_argument("-f option must be either float or fixed");
+		}
+		if (str_arg == "-l") {
+			if (next_arg == "planar") {}
+			else if (next_arg == "interleaved") layout = INTERLEAVED_LAYOUT;
+			else throw std::invalid_argument("-l option must be either planar or interleaved");
+		}
+		if (str_arg == "-n") {
+			if (next_arg == "1" || next_arg == "2" || next_arg == "3") in_flight = std::stoul(next_arg);
+			else throw std::invalid_argument("-n option must be either 1, 2 or 3");
+		}
+		if (str_arg == "-r") {
+			if (!next_arg.empty() && next_arg.find_first_not_of("0123456789") == std::string::npos && std::stoul(next_arg) > 0) stripe_rows = std::stoul(next_arg);
+			else throw std::invalid_argument("-r option must be a positive number of rows");
+		}
 		if (str_arg == "-i") {
-			file_name = next_arg;
+			if (next_arg.empty()) throw std::invalid_argument("-i option must be followed by a file name");
+			file_names.push_back(next_arg);
+		}
+		if (str_arg == "-b") {
+			const auto batch = batch_files(next_arg);
+			file_names.insert(file_names.end(), batch.begin(), batch.end());
+		}
+		if (str_arg == "-o") {
+			if (next_arg.empty()) throw std::invalid_argument("-o option must be followed by a file name");
+			output_file_name = next_arg;
 		}
 	}
 
-	if (file_name.empty()) throw std::invalid_argument("a file name must be specified with -i <filename>");
+	if (file_names.empty()) throw std::invalid_argument("a file name must be specified with -i <filename> or -b <directory|pattern|manifest>");
 	
-	return Options(debug, false, bits, color_mode, file_name);
+#if cimg_display == 0
+	// builds without display support can only write their output
+	if (output_file_name.empty()) throw std::invalid_argument("this build has no display, an output file must be specified with -o <filename>");
+#endif
+
+	return Options(debug, false, large_images, bits, color_mode, color_math, layout, in_flight, stripe_rows, file_names, output_file_name);
 }
 
 void print_build_status(const cl::Program& program, const cl::Context& context) {
@@ -137,65 +253,622 @@ std::string relative_path() {
 	return path.substr(0, index);
 }
 
+// 64-bit FNV-1a hash, chained through hash for several strings.
+// The embedded source's own hash, kernel_source_hash, is computed by embed_kernels.ps1 with it.
+auto fnv1a(const std::string& data, cl_ulong hash = 14695981039346656037ull) -> cl_ulong {
+	for (const char c: data) {
+		hash ^= (u8)c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+auto image_path(const std::string& path, const std::string& file_name) -> std::string {
+	// images are looked up as given first, and then in the project's images directory
+	if (std::ifstream(file_name)) return file_name;
+	return path + "images/" + file_name;
+}
+
+void make_directory(const std::string& directory) {
+	// every missing level of the path is created in turn. An existing directory is not an error here,
+	// and any other failure shows up when writing into it.
+	size_t end = 0;
+	do {
+		end = directory.find_first_of("/\\", end + 1);
+		const std::string level = directory.substr(0, end);
+#ifdef _WIN32
+		_mkdir(level.c_str());
+#else
+		mkdir(level.c_str(), 0755);
+#endif
+	} while (end != std::string::npos && end + 1 < directory.size());
+}
+
+void write_cache_file(const std::string& file_name, const char* data, const size_t size) {
+	// the file is written under a name unique to this process first and then renamed into place, so that
+	// another process never loads half of it, even when several are writing the same file at once. If
+	// the rename fails another process's copy is already there, and this one is dropped.
+#ifdef _WIN32
+	const std::string temp_filename = file_name + "." + std::to_string(_getpid()) + ".tmp";
+#else
+	const std::string temp_filename = file_name + "." + std::to_string(getpid()) + ".tmp";
+#endif
+	std::ofstream file(temp_filename, std::ios::binary);
+	file.write(data, size);
+	file.close();
+
+	if (!file || std::rename(temp_filename.c_str(), file_name.c_str()) != 0)
+		std::remove(temp_filename.c_str());
+}
+
+auto cache_directory() -> std::string {
+	// built programs are cached per user rather than in the working directory, so that runs started
+	// from anywhere share them. Without a home to put them in they are cached where the program runs.
+#ifdef _WIN32
+	char base[MAX_PATH];
+	const DWORD length = GetEnvironmentVariableA("LOCALAPPDATA", base, MAX_PATH);
+	if (length > 0 && length < MAX_PATH) return std::string(base) + "\\ParallelAssessment\\kernel_cache\\";
+#else
+	const char* xdg_cache = std::getenv("XDG_CACHE_HOME");
+	const char* home = std::getenv("HOME");
+	if (xdg_cache && *xdg_cache) return std::string(xdg_cache) + "/ParallelAssessment/kernel_cache/";
+	if (home && *home) return std::string(home) + "/.cache/ParallelAssessment/kernel_cache/";
+#endif
+	return "kernel_cache/";
+}
+
+auto same_file(const std::string& first, const std::string& second) -> bool {
+	// files are compared by identity rather than name, so different paths to one file are caught too
+#ifdef _WIN32
+	BY_HANDLE_FILE_INFORMATION info[2];
+	const std::string names[2] = {first, second};
+	for (u32 i = 0; i < 2; ++i) {
+		HANDLE file = CreateFileA(names[i].c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		const BOOL found = GetFileInformationByHandle(file, &info[i]);
+		CloseHandle(file);
+		if (!found) return false;
+	}
+	return info[0].dwVolumeSerialNumber == info[1].dwVolumeSerialNumber
+		&& info[0].nFileIndexHigh == info[1].nFileIndexHigh
+		&& info[0].nFileIndexLow == info[1].nFileIndexLow;
+#else
+	struct stat first_info, second_info;
+	if (stat(first.c_str(), &first_info) != 0 || stat(second.c_str(), &second_info) != 0) return false;
+	return first_info.st_dev == second_info.st_dev && first_info.st_ino == second_info.st_ino;
+#endif
+}
+
+/*
+A file mapped into memory, so that pixels are read from and written to it without going through stream
+buffers. Existing files are mapped copy-on-write, so kernels may equalize their pixels in place without
+changing the file, and new files are created at their final size, with their space reserved up front so
+that a full disk is an error rather than a fault when the mapping is written. The mapping is released with
+the object.
+*/
+class MappedFile {
+	u8*    _data;
+	size_t _size;
+
+public:
+	MappedFile(): _data(nullptr), _size(0) {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	auto open(const std::string&) -> bool;
+	void create(const std::string&, const size_t);
+	void close();
+
+	auto data() const -> u8* { return _data; }
+	auto size() const -> size_t { return _size; }
+};
+
+auto MappedFile::open(const std::string& file_name) -> bool {
+	// the file and mapping handles can be closed straight away, the view keeps the mapping alive
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = GetFileSizeEx(file, &size)? CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr) : nullptr;
+	CloseHandle(file);
+	if (!mapping) return false;
+
+	_data = (u8*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!_data) return false;
+	_size = (size_t)size.QuadPart;
+#else
+	ci32 file = ::open(file_name.c_str(), O_RDONLY);
+	if (file < 0) return false;
+
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0) {
+		::close(file);
+		return false;
+	}
+
+	void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	::close(file);
+	if (data == MAP_FAILED) return false;
+	_data = (u8*)data;
+	_size = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::create(const std::string& file_name, const size_t size) {
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("can't create " + file_name);
+
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG)size;
+	if (!SetFilePointerEx(file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+		CloseHandle(file);
+		throw std::runtime_error("can't allocate " + std::to_string(size) + " bytes for " + file_name);
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping) throw std::runtime_error("can't map " + file_name);
+
+	_data = (u8*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	CloseHandle(mapping);
+#else
+	ci32 file = ::open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file < 0) throw std::runtime_error("can't create " + file_name);
+
+	if (posix_fallocate(file, 0, (off_t)size) != 0) {
+		::close(file);
+		throw std::runtime_error("can't allocate " + std::to_string(size) + " bytes for " + file_name);
+	}
+
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	::close(file);
+	_data = (data == MAP_FAILED)? nullptr : (u8*)data;
+#endif
+	if (!_data) throw std::runtime_error("can't map " + file_name);
+	_size = size;
+}
+
+void MappedFile::close() {
+	if (!_data) return;
+#ifdef _WIN32
+	UnmapViewOfFile(_data);
+#else
+	munmap(_data, _size);
+#endif
+	_data = nullptr;
+	_size = 0;
+}
+
+/*
+Binary pgm (P5) and ppm (P6) files are a short text header followed by the raw samples, interleaved
+for ppm and big-endian when they are wider than a byte. Only those are read and written here, CImg
+handles every other format.
+*/
+struct PnmHeader {
+	u32    channels, width, height, max_value;
+	size_t offset;
+};
+
+auto is_pnm(const std::string& file_name) -> bool {
+	const char* extension = cimg::split_filename(file_name.c_str());
+	return !cimg::strcasecmp(extension, "pgm") || !cimg::strcasecmp(extension, "ppm") || !cimg::strcasecmp(extension, "pnm");
+}
+
+auto parse_pnm_header(const u8* data, const size_t size, PnmHeader& header) -> bool {
+	if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) return false;
+	header.channels = (data[1] == '6')? 3 : 1;
+
+	// the width, height and max value are separated by whitespace and comments running to the end of a line
+	size_t i = 2;
+	u32* fields[] = {&header.width, &header.height, &header.max_value};
+	for (u32* field: fields) {
+		while (i < size && (std::isspace(data[i]) || data[i] == '#'))
+			if (data[i++] == '#') while (i < size && data[i] != '\n') ++i;
+
+		if (i == size || !std::isdigit(data[i])) return false;
+		for (*field = 0; i < size && std::isdigit(data[i]); ++i) *field = *field * 10 + (data[i] - '0');
+	}
+
+	// exactly one whitespace character separates the header from the samples
+	if (i == size || !std::isspace(data[i]) || !header.width || !header.height || !header.max_value || header.max_value > 65535) return false;
+	header.offset = i + 1;
+
+	const size_t sample_size = (header.max_value > 255)? 2 : 1;
+	return (size - header.offset) / sample_size / header.channels / header.width >= header.height;
+}
+
+template<typename T>
+auto load_pnm(MappedFile& file, CImg<T>& image, cbool interleaved) -> bool {
+	// only files whose samples are the width of T are read, the rest are left to CImg to convert.
+	// Interleaved ppm pixels are kept as they are, in a CImg whose x axis is the channel ("cxyz").
+	PnmHeader header;
+	if (!parse_pnm_header(file.data(), file.size(), header) || (header.max_value > 255) != (sizeof(T) == 2)) return false;
+
+	const u8* samples = file.data() + header.offset;
+	const size_t pixels = (size_t)header.width * header.height;
+	cbool packed = interleaved || header.channels == 1;
+
+	// 8-bit samples that are already laid out as the image wants them are shared rather than copied
+	if (sizeof(T) == 1 && packed) {
+		if (header.channels == 3) image.assign((T*)samples, 3, header.width, header.height, 1, true);
+		else image.assign((T*)samples, header.width, header.height, 1, 1, true);
+		return true;
+	}
+
+	if (packed && header.channels == 3) image.assign(3, header.width, header.height, 1);
+	else image.assign(header.width, header.height, 1, header.channels);
+
+	// otherwise the samples are split into CImg's planes if needed and byte swapped in a single pass
+	T* values = image.data();
+	for (size_t i = 0; i < pixels; ++i) {
+		for (u32 c = 0; c < header.channels; ++c) {
+			const size_t index = i * header.channels + c;
+			const u8* sample = samples + index * sizeof(T);
+			values[packed? index : c * pixels + i] = (sizeof(T) == 1)? sample[0] : (T)((sample[0] << 8) | sample[1]);
+		}
+	}
+	return true;
+}
+
+template<typename T>
+auto pnm_header(const u32 channels, const u32 width, const u32 height) -> std::string {
+	// the header is padded to a multiple of 16 bytes with spaces before the max value, which pnm allows,
+	// so that samples written straight after it in a mapped file are aligned for T
+	std::ostringstream header;
+	header << ((channels == 3)? "P6" : "P5") << "\n" << width << " " << height << "\n";
+	const std::string max_value = std::to_string((1 << (8 * sizeof(T))) - 1) + "\n";
+	const size_t size = header.str().size() + max_value.size();
+	return header.str() + std::string((16 - size % 16) % 16, ' ') + max_value;
+}
+
+template<typename T>
+void save_pnm(const CImg<T>& image, const std::string& file_name) {
+	// the planes are interleaved and byte swapped straight into a mapping of the new file
+	const std::string header = pnm_header<T>(image.spectrum(), image.width(), image.height());
+	const size_t pixels = (size_t)image.width() * image.height();
+	const u32 channels = image.spectrum();
+
+	MappedFile file;
+	file.create(file_name, header.size() + image.size() * sizeof(T));
+	std::memcpy(file.data(), header.data(), header.size());
+
+	u8* samples = file.data() + header.size();
+	for (u32 c = 0; c < channels; ++c) {
+		const T* plane = image.data(0, 0, 0, c);
+		for (size_t i = 0; i < pixels; ++i) {
+			u8* sample = samples + (i * channels + c) * sizeof(T);
+			if (sizeof(T) == 1) sample[0] = (u8)plane[i];
+			else {
+				sample[0] = (u8)(plane[i] >> 8);
+				sample[1] = (u8)plane[i];
+			}
+		}
+	}
+}
+
+/*
+Device buffers that are kept alive between images, each identified by its role in the pipeline.
+A buffer is only reallocated when a request doesn't fit it, and sizes are rounded up to a power of two
+so that a sequence of slowly growing images doesn't reallocate every time, though never beyond the
+largest buffer the device can allocate.
+*/
+class BufferPool {
+	struct Entry {
+		size_t       size;
+		cl_mem_flags flags;
+		cl::Buffer   buffer;
+	};
+
+	cl::Context                  _context;
+	size_t                       _max_size;
+	std::map<std::string, Entry> _entries;
+
+public:
+	BufferPool(): _max_size(0) {}
+	BufferPool(const cl::Context& context, const size_t max_size): _context(context), _max_size(max_size) {}
+
+	auto bucket(const size_t) const -> size_t;
+	auto get(const std::string&, const size_t, const cl_mem_flags = CL_MEM_READ_WRITE) -> const cl::Buffer&;
+	void release(const std::string&);
+};
+
+auto BufferPool::bucket(const size_t size) const -> size_t {
+	size_t bucket = 1;
+	while (bucket < size) bucket <<= 1;
+
+	if (bucket <= _max_size) return bucket;
+	return (size < _max_size)? _max_size : size;
+}
+
+auto BufferPool::get(const std::string& name, const size_t size, const cl_mem_flags flags) -> const cl::Buffer& {
+	auto entry = _entries.find(name);
+	if (entry != _entries.end() && entry->second.size >= size && entry->second.flags == flags)
+		return entry->second.buffer;
+
+	Entry& created = _entries[name];
+	created.size = bucket(size);
+	created.flags = flags;
+	created.buffer = cl::Buffer(_context, flags, created.size);
+	return created.buffer;
+}
+
+void BufferPool::release(const std::string& name) {
+	_entries.erase(name);
+}
+
+/*
+A bounded queue between exactly one producer thread and one consumer thread. Each side only writes its
+own index, so no lock is needed: the producer publishes an item by advancing the tail once it is stored,
+and the consumer gives its place back by advancing the head once it is taken.
+The blocking push and pop sleep on a condition variable while the queue is full or empty, so a stage
+that is waiting on another doesn't take a core from it. The other side only takes the lock to wake
+them when one is asleep, and sleepers check every few milliseconds whether a failing thread set stop.
+*/
+template<typename T>
+class SpscQueue {
+	std::vector<T>          _items;
+	std::atomic<size_t>     _head, _tail;
+	std::atomic<u32>        _waiting;
+	std::mutex              _mutex;
+	std::condition_variable _changed;
+
+	auto _try_push(const T&) -> bool;
+	auto _try_pop(T&) -> bool;
+	void _notify();
+	template<typename F> auto _wait(const F&, const std::atomic<bool>&) -> bool;
+
+public:
+	SpscQueue(const size_t capacity): _items(capacity + 1), _head(0), _tail(0), _waiting(0) {}
+
+	auto try_push(const T&) -> bool;
+	auto try_pop(T&) -> bool;
+	auto push(const T&, const std::atomic<bool>&) -> bool;
+	auto pop(T&, const std::atomic<bool>&) -> bool;
+};
+
+// the indices are sequentially consistent so that a side advancing one and then finding nobody waiting
+// can't miss a sleeper that has just found the queue unchanged
+template<typename T>
+auto SpscQueue<T>::_try_push(const T& item) -> bool {
+	const size_t tail = _tail.load(std::memory_order_relaxed);
+	const size_t next = (tail + 1) % _items.size();
+	if (next == _head.load()) return false;
+
+	_items[tail] = item;
+	_tail.store(next);
+	return true;
+}
+
+template<typename T>
+auto SpscQueue<T>::_try_pop(T& item) -> bool {
+	const size_t head = _head.load(std::memory_order_relaxed);
+	if (head == _tail.load()) return false;
+
+	item = _items[head];
+	_head.store((head + 1) % _items.size());
+	return true;
+}
+
+template<typename T>
+void SpscQueue<T>::_notify() {
+	if (!_waiting) return;
+
+	// taking the lock orders the wake-up after a sleeper has checked the queue and released it
+	{ std::lock_guard<std::mutex> lock(_mutex); }
+	_changed.notify_all();
+}
+
+template<typename T>
+template<typename F>
+auto SpscQueue<T>::_wait(const F& ready, const std::atomic<bool>& stop) -> bool {
+	bool done = ready();
+
+	if (!done) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		++_waiting;
+		while (!(done = ready()) && !stop)
+			_changed.wait_for(lock, std::chrono::milliseconds(10));
+		--_waiting;
+	}
+
+	if (done) _notify();
+	return done;
+}
+
+template<typename T>
+auto SpscQueue<T>::try_push(const T& item) -> bool {
+	if (!_try_push(item)) return false;
+	_notify();
+	return true;
+}
+
+template<typename T>
+auto SpscQueue<T>::try_pop(T& item) -> bool {
+	if (!_try_pop(item)) return false;
+	_notify();
+	return true;
+}
+
+template<typename T>
+auto SpscQueue<T>::push(const T& item, const std::atomic<bool>& stop) -> bool {
+	return _wait([&]() { return _try_push(item); }, stop);
+}
+
+template<typename T>
+auto SpscQueue<T>::pop(T& item, const std::atomic<bool>& stop) -> bool {
+	return _wait([&]() { return _try_pop(item); }, stop);
+}
+
 template <typename T>
 class HistFilter {
-	std::string _image_filename, _kernel_filename;
 	i32         _platform_id, _device_id;
 	ColorMode   _color_mode;
 	bool        _debug;
 	
+	/*
+	Everything an image needs while it is in flight. Each slot has its own queue, buffers and kernel
+	objects, so the next image can be uploaded and histogrammed on one slot while the device is still
+	looking up and downloading the previous one on another.
+	*/
+	struct Slot {
+		cl::CommandQueue                  queue;
+		BufferPool                        buffers;
+		std::map<std::string, cl::Kernel> kernels;
+
+		bool             busy;
+		size_t           index, pixels;
+		std::string      file_name, output_name;
+		MappedFile       input_file, output_file;
+		bool             mapped;
+		std::chrono::steady_clock::time_point started;
+		CImg<T>          input_image;
+		CImgDisplay      input_disp;
+		cl::Buffer       input_buffer, output_buffer;
+		cl::Event        downloaded, cdf_read;
+		std::vector<u32> hist_vector;
+		std::vector<T>   cdf_vector, output_vector;
+		T*               output_data;
+	};
+
 	cl::Context          _context;
-	cl::CommandQueue     _queue;
 	cl::Program::Sources _sources;
 	cl::Program          _program;
+	std::string          _cache_name;
 	cl::Device           _device;
+	u32                  _hist_copies;
+	bool                 _fixed_point;
+	bool                 _local_lut;
+	bool                 _local_cdf;
+	bool                 _zero_copy;
+	bool                 _interleaved;
+	bool                 _large_images;
+	size_t               _count_size;
+	size_t               _hist_groups;
+	size_t               _scan_size;
+	size_t               _stripe_rows;
+	std::vector<Slot>    _slots;
 	
 	auto _max_int() -> size_t;
-	auto _type_prefix() -> std::string;
-	auto _load_image(const std::string&) -> std::pair<CImg<T>, CImgDisplay>;
+	auto _build_options() -> std::string;
+	void _build_program(const std::string&);
+	void _load_image(Slot&, const std::string&, cbool);
+	auto _work_group_size(const cl::Kernel&) -> size_t;
+	auto _create_kernels() -> std::map<std::string, cl::Kernel>;
+	auto _hist(Slot&, const cl::Buffer&, const cl::Buffer&, const size_t, const std::vector<cl::Event>&, cbool = false) -> cl::Event;
+	auto _cdf(Slot&, const cl::Buffer&, const cl::Buffer&, const size_t, const std::vector<cl::Event>&) -> cl::Event;
+	auto _lut(Slot&, const cl::Buffer&, const cl::Buffer&, const std::vector<cl::Event>&) -> cl::Event;
+	auto _lookup(Slot&, const cl::Kernel&, const size_t, const std::vector<cl::Event>&) -> cl::Event;
+	void _check_fixed_point();
+	auto _stripe_height(const Slot&) -> size_t;
+	void _read(Slot&, const std::string&);
+	void _enqueue(Slot&);
+	void _enqueue_stripes(Slot&, const size_t);
+	void _finish(Slot&, cbool);
+	void _wait_all();
+	auto _output_serial(const std::vector<std::string>&, const std::string&) -> size_t;
+	auto _output_threaded(const std::vector<std::string>&, const std::string&) -> size_t;
 
 public:
 	HistFilter(HistFilter<T>&) = delete;
 
+	// commands may still be in flight if an image failed, and they write into memory the slots own
+	~HistFilter() {
+		try {
+			_wait_all();
+		}
+		catch (const cl::Error&) {}
+	}
+
 	HistFilter(
-		const std::string& image_filename,
-		const std::string& kernel_filename,
+		const std::string& cache_directory,
 		ci32& platform_id,
 		ci32& device_id,
 		const ColorMode& color_mode,
+		const ColorMath& color_math,
+		const Layout& layout,
+		const size_t in_flight,
+		const size_t stripe_rows,
+		cbool& large_images,
 		cbool& debug
 	):
-		_image_filename(image_filename),
-		_kernel_filename(kernel_filename),
 		_platform_id(platform_id),
 		_device_id(device_id),
 		_color_mode(color_mode),
-		_debug(debug)
+		_debug(debug),
+		_stripe_rows(stripe_rows)
 	{
 		/*
 		A cl::Context is used so that opencl can manage memory, devives and error handling.
-		Then a cl::CommandQueue is created so that opencl commands can be queued and ran asynchronously.
-		A cl::ProgramSources class is used to retrieve the opencl source code from kernels.cl and then
-		the program is constructed using both our context and sources.
+		Then a cl::CommandQueue per slot is created so that opencl commands can be queued and ran asynchronously.
+		A cl::ProgramSources class holds the opencl source code of kernels.cl, which is embedded in the
+		executable, and then the program is constructed using both our context and sources, unless a
+		binary of it was cached.
 		*/
 		_context = GetContext(_platform_id, _device_id);
-		_queue = cl::CommandQueue(_context);
-		AddSources(_sources, _kernel_filename);
-		_program = cl::Program(_context, _sources);
+		_sources.push_back(std::string(kernel_source, sizeof(kernel_source) - 1));
 		_device = _context.getInfo<CL_CONTEXT_DEVICES>().front();
 
-		// program is built. if debug is enabled the build status is printed regardless of failure.
-		try {
-			_program.build();
-			if (debug) print_build_status(_program, _context);
+		// as many replicated histograms as fit in local memory are used by hist_local, up to 8
+		const size_t copy_size = (_max_int() + 1) * sizeof(u32);
+		const size_t max_copies = _device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / copy_size;
+		_hist_copies = (u32)((max_copies < 8)? max_copies : 8);
+
+		// integer color conversion only applies to 8-bit pixels, and is only used when asked for since it
+		// doesn't reproduce the float path's rounding exactly. It is mostly worth it on cpu devices, where
+		// the float divisions it avoids are expensive.
+		_fixed_point = sizeof(T) == 1 && color_math == FIXED_MATH;
+
+		// RGB pixels are kept interleaved from loading to saving if asked for, planar otherwise
+		_interleaved = layout == INTERLEAVED_LAYOUT && color_mode == RGB;
+
+		// pixels are indexed and counted in 64 bits only if asked for, since it is slower for every image
+		_large_images = large_images;
+		_count_size = _large_images? sizeof(cl_ulong) : sizeof(u32);
+
+		// the lookup kernels stage the lut in local memory if it takes at most half of it
+		_local_lut = 2 * _max_int() * sizeof(T) <= _device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+		// cpu and integrated devices share the host's memory, so the image is given to them in place
+		// and the output is mapped instead of being copied in and out
+		_zero_copy = _device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+
+		_build_program(cache_directory);
+
+		/*
+		Work-items of the histogram kernels stride over the image rather than taking one pixel each,
+		so only a few work-groups are launched per compute unit and the per-group setup and flush costs
+		are paid rarely. The scan's block size is the smallest work-group size its three kernels allow,
+		since they share it, and small histograms are scanned by one work-group in local memory when
+		there is room for them.
+		*/
+		_hist_groups = 4 * _device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+		_scan_size = _work_group_size(cl::Kernel(_program, "scan_blocks"));
+		for (const auto name: {"scan_reduce", "scan_block_sums"}) {
+			const size_t size = _work_group_size(cl::Kernel(_program, name));
+			if (size < _scan_size) _scan_size = size;
 		}
-		catch (const cl::Error& err) {
-			if (!debug) print_build_status(_program, _context);
-			throw err;
+		const size_t cdf_size = _work_group_size(cl::Kernel(_program, "cdf_local"));
+		_local_cdf = (_max_int() + cdf_size + 1) * _count_size <= _device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+		_slots = std::vector<Slot>(in_flight);
+		for (auto& slot: _slots) {
+			slot.queue = cl::CommandQueue(_context);
+			slot.buffers = BufferPool(_context, (size_t)_device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+			slot.kernels = _create_kernels();
+			slot.busy = false;
 		}
+
+		if (_fixed_point) _check_fixed_point();
 	}
 
-	void output();
+	void output(const std::vector<std::string>&, const std::string&);
 };
 
 template<typename T>
@@ -204,185 +877,804 @@ auto HistFilter<T>::_max_int() -> size_t {
 }
 
 template<typename T>
-auto HistFilter<T>::_type_prefix() -> std::string {
-	switch (sizeof(T)) {
-		case 1: return std::string("uchar_");
-		case 2: return std::string("ushort_");
-		// case 4: return std::string("uint_");
+auto HistFilter<T>::_build_options() -> std::string {
+	/*
+	kernels.cl is written once over the pixel type, so it is specialized here with defines for T and the
+	color mode. Knowing the bin count and channel count at build time also lets the compiler unroll and
+	strength-reduce the loops that depend on them.
+	*/
+	std::ostringstream options;
+	options
+		<< "-DPIXEL=" << ((sizeof(T) == 1)? "uchar" : "ushort")
+		<< " -DPIXEL_MAX=" << _max_int() - 1
+		<< " -DBINS=" << _max_int()
+		<< " -DCHANNELS=" << ((_color_mode == RGB)? 3 : 1)
+		<< " -DHIST_COPIES=" << _hist_copies
+		<< " -DFIXED_POINT_COLOR=" << (_fixed_point? 1 : 0)
+		<< " -DLOCAL_LUT=" << (_local_lut? 1 : 0)
+		<< " -DINTERLEAVED=" << (_interleaved? 1 : 0)
+		<< " -DLARGE_IMAGES=" << (_large_images? 1 : 0);
+	return options.str();
+}
+
+template<typename T>
+void HistFilter<T>::_build_program(const std::string& cache_directory) {
+	/*
+	Compiling the kernels takes longer than processing an image on cpu runtimes, so the built binary is
+	cached on disk. Its file name is a hash of everything the binary depends on: the platform, device and
+	driver, the build options and the source. A cached binary that fails to load is rebuilt from source.
+	*/
+	const std::string options = _build_options();
+	const cl::Platform platform = _device.getInfo<CL_DEVICE_PLATFORM>();
+
+	cl_ulong key = fnv1a(platform.getInfo<CL_PLATFORM_NAME>() + "\n", kernel_source_hash);
+	key = fnv1a(platform.getInfo<CL_PLATFORM_VERSION>() + "\n", key);
+	key = fnv1a(_device.getInfo<CL_DEVICE_NAME>() + "\n", key);
+	key = fnv1a(_device.getInfo<CL_DRIVER_VERSION>() + "\n", key);
+	key = fnv1a(options, key);
+
+	std::ostringstream cache_name;
+	cache_name << cache_directory << std::hex << key;
+	_cache_name = cache_name.str();
+	const std::string cache_filename = _cache_name + ".bin";
+
+	std::ifstream cached(cache_filename, std::ios::binary);
+	if (cached) {
+		const cl::Program::Binaries binaries{
+			std::vector<unsigned char>(std::istreambuf_iterator<char>(cached), std::istreambuf_iterator<char>())
+		};
+
+		try {
+			_program = cl::Program(_context, {_device}, binaries);
+			_program.build(options.c_str());
+			if (_debug) std::cout << "Loaded program binary " << cache_filename << "\n";
+			return;
+		}
+		catch (const cl::Error&) {
+			if (_debug) std::cout << "Rebuilding stale program binary " << cache_filename << "\n";
+		}
+	}
+
+	// program is built for T. if debug is enabled the build status is printed regardless of failure.
+	_program = cl::Program(_context, _sources);
+	try {
+		_program.build(options.c_str());
+		if (_debug) print_build_status(_program, _context);
+	}
+	catch (const cl::Error& err) {
+		if (!_debug) print_build_status(_program, _context);
+		throw err;
 	}
-	return std::string("not_found_");
+
+	const auto binaries = _program.getInfo<CL_PROGRAM_BINARIES>();
+	make_directory(cache_directory);
+	write_cache_file(cache_filename, (const char*)binaries.front().data(), binaries.front().size());
 }
 
 template<typename T>
-auto HistFilter<T>::_load_image(const std::string& image_filename) -> std::pair<CImg<T>, CImgDisplay> {
+void HistFilter<T>::_load_image(Slot& slot, const std::string& image_filename, cbool display) {
 	/*
-	This sections loads the input image into a cimage_library::CImg<T>
-	and and passes it by reference into a cimage_library::CImgDisplay so that it can later be displayed
+	This sections loads the input image into the slot's cimage_library::CImg<T>
+	and and passes it by reference into a cimage_library::CImgDisplay so that it can later be displayed.
+	Both are kept in the slot, so the image stays alive for as long as the device may read it.
+	No display is created at all in headless mode.
+	Binary pgm and ppm files are mapped and read without CImg's decoding, and 8-bit ones are used
+	straight from the mapping when they are greyscale or RGB is processed interleaved. Interleaved images
+	have their channels along x, so they are put back in CImg's planar layout only to be displayed.
 	*/
-	CImg<T> image_input(image_filename.c_str());
-	
-	return std::pair<CImg<T>, CImgDisplay>(
-		image_input,
-		CImgDisplay(image_input, "input")
-	);
+	slot.input_image.assign();
+	if (!slot.input_file.open(image_filename) || !load_pnm(slot.input_file, slot.input_image, _interleaved)) {
+		slot.input_file.close();
+		slot.input_image.assign(image_filename.c_str());
+		if (_interleaved) slot.input_image.permute_axes("cxyz");
+	}
+
+	if (display && _interleaved) slot.input_disp.assign(slot.input_image.get_permute_axes("yzcx"), "input");
+	else if (display) slot.input_disp.assign(slot.input_image, "input");
 }
 
 template<typename T>
-void HistFilter<T>::output() {
-	//detect any potential exceptions
-	// this would look better with c++17 structured bindings but alas
+auto HistFilter<T>::_work_group_size(const cl::Kernel& kernel) -> size_t {
+	// work-groups of 256 are a good fit for most devices, but some cpu runtimes limit kernels to less
+	const size_t preferred = 256;
+	const size_t limit = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(_device);
+	return (limit < preferred)? limit : preferred;
+}
 
-	auto prefix = _type_prefix();
-	
-	auto input = _load_image(_image_filename);
-	auto& input_image = input.first;
-	auto& input_disp = input.second;
-	const auto input_size = (size_t)input_image.size();
-	const auto input_height = input_image.height();
-	const auto input_width = input_image.width();
-	const auto input_depth = input_image.depth();
-	const auto input_spectrum = input_image.spectrum();
-	const auto input_pixels = (_color_mode == RGB)? input_size / 3 : input_size;
-	
-	std::cout << "checkpoint 1\n";
-	
-	std::cout << "input_size   " << input_size << "\n";
-	std::cout << "input_pixels " << input_pixels << "\n";
-	
-	// loading input data into buffer
-	cl::Buffer input_buffer(_context, CL_MEM_READ_ONLY, input_size * sizeof(T));
-	_queue.enqueueWriteBuffer(input_buffer, CL_TRUE, 0, input_size * sizeof(T), &input_image.data()[0]);
+template<typename T>
+auto HistFilter<T>::_create_kernels() -> std::map<std::string, cl::Kernel> {
+	/*
+	Every kernel of the program is created once, keyed by its name, and the arguments that are the same
+	for every image (local memory and sizes that only depend on T and the device) are set here, so
+	processing an image only sets its buffers and pixel count.
+	*/
+	std::vector<cl::Kernel> kernel_list;
+	std::map<std::string, cl::Kernel> kernels;
+	_program.createKernels(&kernel_list);
 
-	std::cout << "checkpoint 2\n";
+	for (auto& kernel: kernel_list)
+		kernels[kernel.getInfo<CL_KERNEL_FUNCTION_NAME>()] = kernel;
 
-	cl::Kernel kernel;
-	cl::Buffer cmyk_buffer, k_buffer;
-	std::vector<T> cmyk_vector(4 * input_pixels);
+	const size_t bins = _max_int();
 
-	// if the image is RGB then we need to convert to hsl because it has a lightness channel.
-	if (_color_mode == RGB) {
-		// creating new hsl image buffer
-		cmyk_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE, 4 * input_pixels * sizeof(T));
+	if (_hist_copies)
+		kernels.at("hist_local").setArg(2, cl::Local(_hist_copies * (bins + 1) * sizeof(u32)));
+
+	// histograms too big for local memory never launch cdf_local, so it is only given local memory here
+	if (_local_cdf) {
+		const size_t cdf_size = _work_group_size(kernels.at("cdf_local"));
+		kernels.at("cdf_local").setArg(2, cl::Local(bins * _count_size));
+		kernels.at("cdf_local").setArg(3, cl::Local((cdf_size + 1) * _count_size));
+	}
+
+	const size_t blocks = (bins + _scan_size - 1) / _scan_size;
+	kernels.at("scan_reduce").setArg(2, cl::Local((_scan_size + 1) * _count_size));
+	kernels.at("scan_reduce").setArg(3, bins);
+	kernels.at("scan_block_sums").setArg(1, cl::Local((_scan_size + 1) * _count_size));
+	kernels.at("scan_block_sums").setArg(2, blocks);
+	kernels.at("scan_blocks").setArg(2, cl::Local((_scan_size + 1) * _count_size));
+	kernels.at("scan_blocks").setArg(3, bins);
+
+	const auto local_lut = cl::Local(_local_lut? bins * sizeof(T) : sizeof(T));
+	kernels.at("cdf_lookup").setArg(2, local_lut);
+	kernels.at("cdf_lookup_rgb").setArg(3, local_lut);
+
+	return kernels;
+}
+
+template<typename T>
+auto HistFilter<T>::_hist(
+	Slot& slot,
+	const cl::Buffer& input_buffer,
+	const cl::Buffer& hist_buffer,
+	const size_t pixels,
+	const std::vector<cl::Event>& wait,
+	cbool accumulate
+) -> cl::Event {
+	// work-groups count in 32 bits, so a large image is spread over enough of them that none counts 2^31 pixels
+	const size_t bins = _max_int();
+	const size_t min_groups = (pixels >> 31) + 1;
+	const size_t groups = (_hist_groups > min_groups)? _hist_groups : min_groups;
+	cl::Event cleared, counted;
+	std::vector<cl::Event> count_wait = wait;
+
+	// the histogram is cleared first unless the pixels are added to ones already counted, as the
+	// stripes of an image are
+	if (!accumulate) {
+		slot.queue.enqueueFillBuffer(hist_buffer, (u32)0, 0, bins * _count_size, &wait, &cleared);
+		count_wait = {cleared};
+	}
+
+	if (_hist_copies) {
+		cl::Kernel& kernel = slot.kernels.at("hist_local");
+		const size_t local_size = _work_group_size(kernel);
 
-		// specifying kernel, passing kernel arguments and then loading it into queue
-		kernel = cl::Kernel(_program, (prefix + "rgb_to_cmyk").c_str());
 		kernel.setArg(0, input_buffer);
-		kernel.setArg(1, cmyk_buffer);
-	
-		_queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(input_size), cl::NullRange);
-	
-		// retrieving the hsl data
-		_queue.enqueueReadBuffer(cmyk_buffer, CL_TRUE, 0, 4 * input_pixels * sizeof(T), &cmyk_vector.data()[0]);
+		kernel.setArg(1, hist_buffer);
+		kernel.setArg(3, pixels);
 
-		// only the lightness part of the cmyk array is used to make the histogram so the corresponding data slice is copied
-		k_buffer = cl::Buffer(_context, CL_MEM_READ_WRITE, input_pixels * sizeof(T));
-		_queue.enqueueCopyBuffer(cmyk_buffer, k_buffer, 3 * input_pixels * sizeof(T), 0, input_pixels * sizeof(T));
+		slot.queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size), &count_wait, &counted);
+		return counted;
 	}
-	
-	// hist buffer must have a large int type to prevent overflowing. If the image was all one color
-	// for example, it would be a problem because one value of the histogram would get overflowed.
-	const size_t hist_items = _max_int();
-	const size_t hist_size = hist_items * sizeof(u32);
-	std::vector<u32> hist_vector(hist_items);
-	cl::Buffer hist_buffer(_context, CL_MEM_READ_WRITE, hist_size);
-
-	std::cout << "checkpoint 3\n";
-
-	// histogram is then produced using hist kernel
-	kernel = cl::Kernel(_program, (prefix + "hist").c_str());
-	kernel.setArg(0, (_color_mode == RGB)? k_buffer : input_buffer);
-	kernel.setArg(1, hist_buffer);
-	kernel.setArg(2, cl::Local(2048 * sizeof(u32)));
-	kernel.setArg(3, hist_items);
-	
-	_queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(input_pixels), cl::NullRange);
 
-	std::cout << "checkpoint 4\n";
-	
-	_queue.enqueueReadBuffer(hist_buffer, CL_TRUE, 0, hist_size, &hist_vector.data()[0]);
+	// larger histograms are privatized per work-group in global scratch memory. Every group's slice is
+	// cleared and merged, which costs about as much as counting a few pixels per bin, so a group is only
+	// launched per 4 pixels a bin and small images use just a few slices.
+	cl::Kernel& kernel = slot.kernels.at("hist_global");
+	const size_t local_size = _work_group_size(kernel);
+	const size_t wanted_groups = pixels / (4 * bins);
+	const size_t global_groups = (wanted_groups < min_groups)? min_groups : (wanted_groups < groups)? wanted_groups : groups;
+	const size_t partial_size = global_groups * bins * sizeof(u32);
+	cl::Event partial_cleared, merged;
 
-	std::cout << "checkpoint 5\n";
+	const cl::Buffer& partial_buffer = slot.buffers.get("partial_hist", partial_size);
+	slot.queue.enqueueFillBuffer(partial_buffer, (u32)0, 0, partial_size, &count_wait, &partial_cleared);
 
-	if (_debug) std::cout << "Histogram:\n" << str_vec(hist_vector) << "\n";
+	kernel.setArg(0, input_buffer);
+	kernel.setArg(1, partial_buffer);
+	kernel.setArg(2, pixels);
+
+	const std::vector<cl::Event> partial_wait{partial_cleared};
+	slot.queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_groups * local_size), cl::NDRange(local_size), &partial_wait, &counted);
+
+	cl::Kernel& merge_kernel = slot.kernels.at("hist_merge");
+	merge_kernel.setArg(0, partial_buffer);
+	merge_kernel.setArg(1, hist_buffer);
+	merge_kernel.setArg(2, global_groups);
+
+	const std::vector<cl::Event> merge_wait{counted};
+	slot.queue.enqueueNDRangeKernel(merge_kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange, &merge_wait, &merged);
+	return merged;
+}
+
+template<typename T>
+auto HistFilter<T>::_cdf(
+	Slot& slot,
+	const cl::Buffer& hist_buffer,
+	const cl::Buffer& cdf_buffer,
+	const size_t bins,
+	const std::vector<cl::Event>& wait
+) -> cl::Event {
+	// small histograms are scanned and normalised by one work-group in local memory, in one launch
+	if (_local_cdf) {
+		cl::Kernel& local_kernel = slot.kernels.at("cdf_local");
+		const size_t group_size = _work_group_size(local_kernel);
+		cl::Event normalised;
+
+		local_kernel.setArg(0, hist_buffer);
+		local_kernel.setArg(1, cdf_buffer);
+		slot.queue.enqueueNDRangeKernel(local_kernel, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), &wait, &normalised);
+		return normalised;
+	}
+
+	/*
+	Otherwise the histogram is scanned in place with a reduce-then-scan over three launches, since a barrier
+	can only synchronize one work-group: each work-group sums its block, one work-group scans those
+	block sums, and then each block is scanned again starting from its block's offset.
+	The scanned histogram is then normalised into the lookup table by a separate kernel.
+	*/
+	cl::Kernel& reduce_kernel = slot.kernels.at("scan_reduce");
+	cl::Kernel& block_sums_kernel = slot.kernels.at("scan_block_sums");
+	cl::Kernel& blocks_kernel = slot.kernels.at("scan_blocks");
+	cl::Kernel& normalise_kernel = slot.kernels.at("cdf_normalise");
+	cl::Event reduced, block_sums_scanned, scanned, normalised;
+
+	const size_t local_size = _scan_size;
+	const size_t blocks = (bins + local_size - 1) / local_size;
+	const cl::Buffer& block_sums_buffer = slot.buffers.get("block_sums", blocks * _count_size);
+
+	reduce_kernel.setArg(0, hist_buffer);
+	reduce_kernel.setArg(1, block_sums_buffer);
+	slot.queue.enqueueNDRangeKernel(reduce_kernel, cl::NullRange, cl::NDRange(blocks * local_size), cl::NDRange(local_size), &wait, &reduced);
+
+	block_sums_kernel.setArg(0, block_sums_buffer);
+	const std::vector<cl::Event> block_sums_wait{reduced};
+	slot.queue.enqueueNDRangeKernel(block_sums_kernel, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), &block_sums_wait, &block_sums_scanned);
+
+	blocks_kernel.setArg(0, hist_buffer);
+	blocks_kernel.setArg(1, block_sums_buffer);
+	const std::vector<cl::Event> blocks_wait{block_sums_scanned};
+	slot.queue.enqueueNDRangeKernel(blocks_kernel, cl::NullRange, cl::NDRange(blocks * local_size), cl::NDRange(local_size), &blocks_wait, &scanned);
+
+	normalise_kernel.setArg(0, hist_buffer);
+	normalise_kernel.setArg(1, cdf_buffer);
+	const std::vector<cl::Event> normalise_wait{scanned};
+	slot.queue.enqueueNDRangeKernel(normalise_kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange, &normalise_wait, &normalised);
+	return normalised;
+}
+
+template<typename T>
+void HistFilter<T>::_check_fixed_point() {
+	// every 24-bit RGB value is converted with both the fixed point and float arithmetic, and fixed point
+	// is refused if any channel differs by more than one level. The float path truncates K one level
+	// lower than the exact 255 - max for most maxima above 64, so that one level is expected. The bound
+	// is on the conversions only, equalization can widen it in the output. The launch covers 2^24 items,
+	// so its result is kept beside the program binary, whose key already names the device and driver.
+	const u32 max_error = 1;
+	const std::string check_filename = _cache_name + ".fixed_point";
+	u32 error = 0;
+
+	std::ifstream checked(check_filename);
+	if (!(checked >> error)) {
+		Slot& slot = _slots.front();
+		cl::Buffer error_buffer(_context, CL_MEM_READ_WRITE, sizeof(u32));
+		slot.queue.enqueueWriteBuffer(error_buffer, CL_TRUE, 0, sizeof(u32), &error);
+
+		cl::Kernel& kernel = slot.kernels.at("fixed_point_error");
+		kernel.setArg(0, error_buffer);
+		slot.queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1 << 24), cl::NullRange);
+
+		slot.queue.enqueueReadBuffer(error_buffer, CL_TRUE, 0, sizeof(u32), &error);
+
+		const std::string result = std::to_string(error);
+		write_cache_file(check_filename, result.data(), result.size());
+	}
+	if (_debug) std::cout << "Fixed point color conversion max error: " << error << "\n";
+
+	if (error > max_error)
+		throw std::invalid_argument("fixed point color conversion is off by " + std::to_string(error) + " levels on this device, use -f float");
+}
+
+template<typename T>
+auto HistFilter<T>::_lookup(Slot& slot, const cl::Kernel& kernel, const size_t pixels, const std::vector<cl::Event>& wait) -> cl::Event {
+	// the lookup kernels take 16 pixels per work-item plus one work-item for the remainder,
+	// rounded up to whole work-groups so that every group can stage the lut
+	const size_t local_size = _work_group_size(kernel);
+	const size_t items = pixels / 16 + 1;
+	const size_t global_size = (items + local_size - 1) / local_size * local_size;
+	cl::Event looked_up;
+
+	slot.queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_size), cl::NDRange(local_size), &wait, &looked_up);
+	return looked_up;
+}
+
+template<typename T>
+auto HistFilter<T>::_lut(Slot& slot, const cl::Buffer& hist_buffer, const cl::Buffer& cdf_buffer, const std::vector<cl::Event>& wait) -> cl::Event {
+	const size_t hist_items = _max_int();
+	std::vector<cl::Event> cdf_wait = wait;
+	cl::Event hist_read, cdf_done;
+
+	// the histogram is scanned in place, so a debug read of it has to finish before the cdf starts
+	if (_debug) {
+		slot.hist_vector.resize(hist_items * _count_size / sizeof(u32));
+		slot.queue.enqueueReadBuffer(hist_buffer, CL_FALSE, 0, hist_items * _count_size, &slot.hist_vector.data()[0], &wait, &hist_read);
+		cdf_wait = {hist_read};
+	}
 
 	// a normalized cdf is then produced from the histogram
-	std::vector<T> cdf_vector(hist_items);
-	cl::Buffer cdf_buffer(_context, CL_MEM_READ_WRITE, hist_items * sizeof(T));
+	cdf_done = _cdf(slot, hist_buffer, cdf_buffer, hist_items, cdf_wait);
 
-	std::cout << "checkpoint 6\n";
-	
-	kernel = cl::Kernel(_program, (prefix + "cdf").c_str());
-	kernel.setArg(0, hist_buffer);
-	kernel.setArg(1, cdf_buffer);
-	kernel.setArg(2, input_pixels);
-	kernel.setArg(3, hist_items);
-	
-	_queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(hist_items), cl::NullRange);
+	if (_debug) {
+		slot.cdf_vector.resize(hist_items);
+		const std::vector<cl::Event> read_wait{cdf_done};
+		slot.queue.enqueueReadBuffer(cdf_buffer, CL_FALSE, 0, hist_items * sizeof(T), &slot.cdf_vector.data()[0], &read_wait, &slot.cdf_read);
+	}
+	return cdf_done;
+}
 
-	std::cout << "checkpoint 7\n";
-		
-	_queue.enqueueReadBuffer(cdf_buffer, CL_TRUE, 0, hist_items * sizeof(T), &cdf_vector.data()[0]);
+template<typename T>
+auto HistFilter<T>::_stripe_height(const Slot& slot) -> size_t {
+	/*
+	Images are streamed in stripes when asked to with -r, or when they don't fit on the device whole.
+	Every slot keeps its own buffers and RGB images need an output buffer besides their input, so an
+	image fits if that many of its buffers, as the pool rounds them up, fit in three quarters of the
+	device's memory and each of them in one allocation. The rest is left for the histogram buffers and
+	the runtime. Stripes get at most half of that room, so that rounding them up still fits.
+	Zero means the image is processed whole.
+	*/
+	const auto& image = slot.input_image;
+	const size_t row_pixels = _interleaved? image.height() : image.width();
+	const size_t row_size = ((_color_mode == RGB)? row_pixels * 3 : row_pixels) * sizeof(T);
+	const size_t rows = image.size() * sizeof(T) / row_size;
 
-	std::cout << "checkpoint 8\n";
+	const size_t buffers = _slots.size() * ((_color_mode == RGB)? 2 : 1);
+	const size_t global_room = (size_t)(_device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 4 * 3) / buffers;
+	const size_t max_alloc = (size_t)_device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	const size_t room = (global_room < max_alloc)? global_room : max_alloc;
 
-	if (_debug) std::cout << "Normalised CDF:\n" << str_vec(cdf_vector) << "\n";
+	const size_t fitting_rows = (room / 2 / row_size > 0)? room / 2 / row_size : 1;
 
-	std::vector<T> output_vector(input_size);
+	// stripes asked for with -r are only made as high as fit, and asking for the whole image or more
+	// leaves it to the same check as any other
+	if (_stripe_rows && _stripe_rows < rows) return (_stripe_rows < fitting_rows)? _stripe_rows : fitting_rows;
+	if (slot.buffers.bucket(image.size() * sizeof(T)) <= room) return 0;
+	return fitting_rows;
+}
 
-	if (_color_mode == RGB) {
-		// cdf is then used to create an equalized version of the lightness buffer
-		cl::Buffer equalized_k_buffer(_context, CL_MEM_READ_WRITE, input_pixels * sizeof(T));
-		_queue.enqueueCopyBuffer(cmyk_buffer, equalized_k_buffer, 3 * input_pixels * sizeof(T), 0, input_pixels);
+template<typename T>
+void HistFilter<T>::_read(Slot& slot, const std::string& image_filename) {
+	// the output is created while the input may still be mapped and not yet read by the device, so an
+	// image can't be written over its own file
+	if (!slot.output_name.empty() && same_file(image_filename, slot.output_name))
+		throw std::invalid_argument(image_filename + " can't be written over by its own output");
+
+	// an image's time starts when it is read, before it is decoded
+	slot.started = std::chrono::steady_clock::now();
+	slot.file_name = image_filename;
+	_load_image(slot, image_filename, slot.output_name.empty());
+}
+
+template<typename T>
+void HistFilter<T>::_enqueue(Slot& slot) {
+	//detect any potential exceptions
+	const auto& image_filename = slot.file_name;
+	const auto& input_image = slot.input_image;
+	const auto input_size = (size_t)input_image.size();
+	const auto input_pixels = (_color_mode == RGB)? input_size / 3 : input_size;
+	const auto stripe_height = _stripe_height(slot);
+	slot.pixels = input_pixels;
+
+	// a slot only keeps the buffers of the way it processes its current image, so that whole images and
+	// stripes don't both take up device memory
+	slot.buffers.release(stripe_height? "input" : "stripe");
+	slot.buffers.release(stripe_height? "output" : "stripe_output");
+
+	// the kernels index pixels with 32-bit ints unless built for large images
+	if (!_large_images && input_size >= ((size_t)1 << 31))
+		throw std::invalid_argument(image_filename + " has 2^31 values or more, which needs -g");
 	
-		std::cout << "checkpoint 9 A\n";
+	if (_debug) {
+		std::cout << "input_size   " << input_size << "\n";
+		std::cout << "input_pixels " << input_pixels << "\n";
+		std::cout << "zero_copy    " << _zero_copy << "\n";
+		std::cout << "stripe_rows  " << stripe_height << "\n";
+	}
+
+	// greyscale or interleaved output to a pgm or ppm file is read back straight into a mapping of the
+	// file, after its header. Otherwise it is read back into a vector, or mapped in zero-copy mode.
+	const bool streamed = is_pnm(slot.output_name) && (_interleaved || input_image.spectrum() == 1);
+	slot.mapped = _zero_copy && !streamed && !stripe_height;
+
+	if (streamed) {
+		const std::string header = _interleaved?
+			pnm_header<T>(3, input_image.height(), input_image.depth()) :
+			pnm_header<T>(1, input_image.width(), input_image.height());
+		slot.output_file.create(slot.output_name, header.size() + input_size * sizeof(T));
+		std::memcpy(slot.output_file.data(), header.data(), header.size());
+		slot.output_data = (T*)(slot.output_file.data() + header.size());
+	}
+	else if (!slot.mapped) {
+		slot.output_vector.resize(input_size);
+		slot.output_data = slot.output_vector.data();
+	}
+
+	if (stripe_height) _enqueue_stripes(slot, stripe_height);
+	else {
+		/*
+		The whole pipeline is enqueued without blocking, each command waiting on the event of the one it
+		depends on, and the host only waits for the output to be read back once the slot is finished. The
+		histogram and cdf are only read back when debug output is requested.
+		*/
+		cl::Event uploaded, hist_done, cdf_done, lookup_done;
+		std::vector<cl::Event> hist_wait;
 		
-		kernel = cl::Kernel(_program, (prefix + "cdf_lookup").c_str());
-		kernel.setArg(0, equalized_k_buffer);
-		kernel.setArg(1, cdf_buffer);
+		// loading input data into buffer. All device buffers come from the slot's pool, so they are only
+		// allocated for the first image and again whenever a larger one arrives. In zero-copy mode the
+		// input buffer wraps the image's own memory instead, so there is nothing to upload.
+		// Greyscale images are equalized in place, so only then is the input written by a kernel.
+		const cl_mem_flags input_flags = (_color_mode == RGB)? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE;
+		if (_zero_copy) {
+			slot.input_buffer = cl::Buffer(_context, input_flags | CL_MEM_USE_HOST_PTR, input_size * sizeof(T), slot.input_image.data());
+		}
+		else {
+			slot.input_buffer = slot.buffers.get("input", input_size * sizeof(T), input_flags);
+			slot.queue.enqueueWriteBuffer(slot.input_buffer, CL_FALSE, 0, input_size * sizeof(T), &input_image.data()[0], nullptr, &uploaded);
+			hist_wait.push_back(uploaded);
+		}
+		const cl::Buffer& input_buffer = slot.input_buffer;
+
+		// hist buffer must have a large int type to prevent overflowing. If the image was all one color
+		// for example, it would be a problem because one value of the histogram would get overflowed.
+		// 32-bit counts hold any image that is allowed without -g.
+		const size_t hist_items = _max_int();
+		const cl::Buffer& hist_buffer = slot.buffers.get("hist", hist_items * _count_size);
+		const cl::Buffer& cdf_buffer = slot.buffers.get("cdf", hist_items * sizeof(T));
+
+		// histogram is then produced using hist kernel. In RGB mode it only counts the K channel, which
+		// the kernel computes from the RGB input itself.
+		hist_done = _hist(slot, input_buffer, hist_buffer, input_pixels, hist_wait);
+		cdf_done = _lut(slot, hist_buffer, cdf_buffer, {hist_done});
+
+		if (_color_mode == RGB) {
+			// in zero-copy mode the output is allocated in host visible memory and mapped once it is done
+			const cl_mem_flags output_flags = _zero_copy? CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR : CL_MEM_READ_WRITE;
+			slot.output_buffer = slot.buffers.get("output", input_size * sizeof(T), output_flags);
 
-		_queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(input_pixels), cl::NullRange);
+			// the cdf is used to equalize the K channel, which is recomputed from the RGB input and
+			// converted straight back to RGB by the same kernel
+			cl::Kernel& kernel = slot.kernels.at("cdf_lookup_rgb");
+			kernel.setArg(0, input_buffer);
+			kernel.setArg(1, slot.output_buffer);
+			kernel.setArg(2, cdf_buffer);
+			kernel.setArg(4, input_pixels);
 
-		std::cout << "checkpoint 13 A\n";
+			lookup_done = _lookup(slot, kernel, input_pixels, {cdf_done});
+		}
+		else {
+			// the lut is applied in place on the input, which the histogram is done reading by the time the
+			// cdf is ready, so the image is only uploaded once and no second buffer is needed
+			slot.output_buffer = input_buffer;
+
+			cl::Kernel& kernel = slot.kernels.at("cdf_lookup");
+			kernel.setArg(0, slot.output_buffer);
+			kernel.setArg(1, cdf_buffer);
+			kernel.setArg(3, input_pixels);
+
+			lookup_done = _lookup(slot, kernel, input_pixels, {cdf_done});
+		}
+
+		const std::vector<cl::Event> download_wait{lookup_done};
+		if (slot.mapped)
+			slot.output_data = (T*)slot.queue.enqueueMapBuffer(slot.output_buffer, CL_FALSE, CL_MAP_READ, 0, input_size * sizeof(T), &download_wait, &slot.downloaded);
+		else
+			slot.queue.enqueueReadBuffer(slot.output_buffer, CL_FALSE, 0, input_size * sizeof(T), slot.output_data, &download_wait, &slot.downloaded);
+	}
 
-		_queue.enqueueCopyBuffer(equalized_k_buffer, cmyk_buffer, 0, 3 * input_pixels * sizeof(T), input_pixels * sizeof(T));
-			
-		// the new equalized 
-		cl::Buffer output_buffer(_context, CL_MEM_READ_WRITE, input_size * sizeof(T));
-		kernel = cl::Kernel(_program, (prefix + "cmyk_to_rgb").c_str());
-		kernel.setArg(0, /*equalized_*/cmyk_buffer);
+	// the commands are submitted now rather than when the slot is next waited on, so the device can
+	// start on them while the host loads and enqueues the next image
+	slot.queue.flush();
+	slot.busy = true;
+}
+
+template<typename T>
+void HistFilter<T>::_enqueue_stripes(Slot& slot, const size_t stripe_height) {
+	/*
+	Images too large for one device buffer are equalized a horizontal stripe of rows at a time, in two
+	passes. The first uploads each stripe and adds it to one histogram. Once the cdf is made from that,
+	the second uploads each stripe again, looks it up and reads it back into its place in the output, so
+	only one stripe of input and one of output are ever on the device.
+	Planar RGB stripes are the same rows of each of the three planes, which are copied as three ranges
+	and laid out as a small planar image on the device.
+	*/
+	const auto& input_image = slot.input_image;
+	const size_t row_pixels = _interleaved? input_image.height() : input_image.width();
+	const size_t rows = slot.pixels / row_pixels;
+	const size_t stripes = (rows + stripe_height - 1) / stripe_height;
+	const size_t planes = (_color_mode == RGB && !_interleaved)? 3 : 1;
+	const size_t pixel_values = _interleaved? 3 : 1;
+	const size_t stripe_size = stripe_height * row_pixels * pixel_values * planes * sizeof(T);
+
+	const cl_mem_flags input_flags = (_color_mode == RGB)? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE;
+	const cl::Buffer& stripe_buffer = slot.buffers.get("stripe", stripe_size, input_flags);
+	const cl::Buffer& output_buffer = (_color_mode == RGB)? slot.buffers.get("stripe_output", stripe_size) : stripe_buffer;
+
+	const size_t hist_items = _max_int();
+	const cl::Buffer& hist_buffer = slot.buffers.get("hist", hist_items * _count_size);
+	const cl::Buffer& cdf_buffer = slot.buffers.get("cdf", hist_items * sizeof(T));
+
+	auto stripe_pixels = [&](const size_t stripe) -> size_t {
+		const size_t first_row = stripe * stripe_height;
+		const size_t last_row = (first_row + stripe_height < rows)? first_row + stripe_height : rows;
+		return (last_row - first_row) * row_pixels;
+	};
+
+	// a stripe is uploaded from the input image, or read back into the output
+	auto copy_stripe = [&](const size_t stripe, cbool upload, const std::vector<cl::Event>& wait) -> std::vector<cl::Event> {
+		const size_t first_pixel = stripe * stripe_height * row_pixels;
+		const size_t size = stripe_pixels(stripe) * pixel_values * sizeof(T);
+		std::vector<cl::Event> copied(planes);
+
+		for (size_t plane = 0; plane < planes; ++plane) {
+			const size_t host_offset = (plane * slot.pixels + first_pixel) * pixel_values;
+			if (upload)
+				slot.queue.enqueueWriteBuffer(stripe_buffer, CL_FALSE, plane * size, size, slot.input_image.data() + host_offset, &wait, &copied[plane]);
+			else
+				slot.queue.enqueueReadBuffer(output_buffer, CL_FALSE, plane * size, size, slot.output_data + host_offset, &wait, &copied[plane]);
+		}
+		return copied;
+	};
+
+	std::vector<cl::Event> wait;
+	cl::Event counted, looked_up;
+
+	for (size_t stripe = 0; stripe < stripes; ++stripe) {
+		const auto uploaded = copy_stripe(stripe, true, wait);
+		counted = _hist(slot, stripe_buffer, hist_buffer, stripe_pixels(stripe), uploaded, stripe > 0);
+		wait = {counted};
+	}
+
+	wait = {_lut(slot, hist_buffer, cdf_buffer, wait)};
+
+	cl::Kernel& kernel = slot.kernels.at((_color_mode == RGB)? "cdf_lookup_rgb" : "cdf_lookup");
+	const cl_uint pixels_arg = (_color_mode == RGB)? 4 : 3;
+	kernel.setArg(0, stripe_buffer);
+	if (_color_mode == RGB) {
 		kernel.setArg(1, output_buffer);
+		kernel.setArg(2, cdf_buffer);
+	}
+	else kernel.setArg(1, cdf_buffer);
 
-		_queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(4 * input_pixels), cl::NullRange);
+	for (size_t stripe = 0; stripe < stripes; ++stripe) {
+		const auto uploaded = copy_stripe(stripe, true, wait);
+		kernel.setArg(pixels_arg, stripe_pixels(stripe));
+		looked_up = _lookup(slot, kernel, stripe_pixels(stripe), uploaded);
+		wait = copy_stripe(stripe, false, {looked_up});
+	}
 
-		std::cout << "checkpoint 14 A\n";
-		
-		_queue.enqueueReadBuffer(output_buffer, CL_TRUE, 0, input_size * sizeof(T), &output_vector.data()[0]);
+	// the stripes are all read back in order, so the last read finishing means the output is complete
+	slot.downloaded = wait.back();
+}
+
+template<typename T>
+void HistFilter<T>::_finish(Slot& slot, cbool numbered) {
+	const auto& input_image = slot.input_image;
+	slot.downloaded.wait();
 
-		std::cout << "checkpoint 15 A\n";
+	// an image's time runs from loading it to having its output back on the host. Images overlap, so
+	// these don't add up to the batch's time.
+	if (numbered) {
+		const std::chrono::duration<f64> elapsed = std::chrono::steady_clock::now() - slot.started;
+		std::cout
+			<< "image " << slot.index << " (" << slot.file_name << "): "
+			<< elapsed.count() * 1e3 << " ms, "
+			<< slot.pixels / elapsed.count() / 1e6 << " Mpixel/s\n";
+	}
+
+	if (_debug) {
+		slot.cdf_read.wait();
+		if (_large_images) {
+			// 64-bit counts are read back as pairs of words
+			std::vector<cl_ulong> counts(slot.hist_vector.size() / 2);
+			std::memcpy(counts.data(), slot.hist_vector.data(), counts.size() * sizeof(cl_ulong));
+			std::cout << "Histogram:\n" << str_vec(counts) << "\n";
+		}
+		else std::cout << "Histogram:\n" << str_vec(slot.hist_vector) << "\n";
+		std::cout << "Normalised CDF:\n" << str_vec(slot.cdf_vector) << "\n";
+	}
+	
+	// displaying hsl image, or saving it in headless mode. The image shares the output's memory rather
+	// than copying it, and is laid out like the input.
+	CImg<T> output_image(slot.output_data, input_image.width(), input_image.height(), input_image.depth(), input_image.spectrum(), true);
+
+	if (slot.output_file.data()) {
+		// output streamed into a pnm file only needs wide samples swapped to big-endian in place
+		if (sizeof(T) == 2)
+			for (T& value: output_image) value = (T)((value >> 8) | (value << 8));
+		slot.output_file.close();
 	}
 	else {
-		
-		cl::Buffer output_buffer(_context, CL_MEM_READ_ONLY, input_size * sizeof(T));
-		_queue.enqueueWriteBuffer(output_buffer, CL_TRUE, 0, input_size * sizeof(T), &input_image.data()[0]);
+		const CImg<T> planar_image = _interleaved? output_image.get_permute_axes("yzcx") : CImg<T>(output_image, true);
 
-		kernel = cl::Kernel(_program, (prefix + "cdf_lookup").c_str());
-		kernel.setArg(0, output_buffer);
-		kernel.setArg(1, cdf_buffer);
+		if (is_pnm(slot.output_name) && (planar_image.spectrum() == 1 || planar_image.spectrum() == 3)) {
+			save_pnm(planar_image, slot.output_name);
+		}
+		else if (!slot.output_name.empty()) {
+			planar_image.save(slot.output_name.c_str());
+		}
+		else {
+			CImgDisplay output_disp(planar_image, "output");
+			while (!output_disp.is_keyESC() && !output_disp.is_closed()) output_disp.wait(1);
+		}
+	}
 
-		std::cout << "checkpoint 9 B\n";
-		
-		_queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(input_pixels), cl::NullRange);
+	// the unmap is waited on, since the slot's next image may release the memory the buffers wrap
+	if (slot.mapped) {
+		cl::Event unmapped;
+		slot.queue.enqueueUnmapMemObject(slot.output_buffer, slot.output_data, nullptr, &unmapped);
+		unmapped.wait();
+	}
 
-		std::cout << "checkpoint 10 B\n";
-		
-		_queue.enqueueReadBuffer(output_buffer, CL_TRUE, 0, input_size * sizeof(T), &output_vector.data()[0]);
+	// in zero-copy mode the buffers may wrap the image's memory, which goes when the slot is reused
+	slot.input_buffer = cl::Buffer();
+	slot.output_buffer = cl::Buffer();
+	slot.busy = false;
+}
+
+template<typename T>
+void HistFilter<T>::_wait_all() {
+	// every queue is finished, since an image that failed halfway through enqueueing isn't marked busy
+	for (auto& slot: _slots)
+		if (slot.queue()) slot.queue.finish();
+}
+
+template<typename T>
+auto HistFilter<T>::_output_serial(const std::vector<std::string>& image_filenames, const std::string& output_filename) -> size_t {
+	/*
+	Images are given to the slots in turn, and a slot's previous image is only waited on and shown when
+	the slot comes round again. With two or more slots the next image's upload and histogram are
+	queued before the current one is waited on, so they overlap its lookup and download on the device.
+	*/
+	cbool numbered = image_filenames.size() > 1;
+	size_t next = 0, pixels = 0;
+	std::vector<char> numbered_name(output_filename.size() + 32);
+
+	try {
+		for (const auto& image_filename: image_filenames) {
+			Slot& slot = _slots[next % _slots.size()];
+			if (slot.busy) _finish(slot, numbered);
+
+			slot.index = next++;
+			slot.output_name = (numbered && !output_filename.empty())?
+				cimg::number_filename(output_filename.c_str(), (i32)slot.index, 6, numbered_name.data()) : output_filename;
+
+			_read(slot, image_filename);
+			_enqueue(slot);
+			pixels += slot.pixels;
+		}
+
+		// the images still in flight are finished in the order they were enqueued
+		for (size_t i = 0; i < _slots.size(); ++i) {
+			Slot& slot = _slots[next++ % _slots.size()];
+			if (slot.busy) _finish(slot, numbered);
+		}
 	}
-	
-	// displaying hsl image
-	CImg<T> output_image(output_vector.data(), input_width, input_height, input_depth, input_spectrum);
-	CImgDisplay output_disp(output_image, "output");
+	catch (...) {
+		// the other slots' reads and writes are waited on before their memory can be released
+		_wait_all();
+		throw;
+	}
+
+	return pixels;
+}
+
+template<typename T>
+auto HistFilter<T>::_output_threaded(const std::vector<std::string>& image_filenames, const std::string& output_filename) -> size_t {
+	/*
+	A batch written to files is run as a pipeline of three threads, so that reading and decoding the next
+	images and encoding and writing the last ones happen while the device works on those in between.
+	Uploads, kernels and downloads are already run by the device from each slot's queue, so one thread
+	enqueueing them is enough for them to overlap.
+	- the reader takes a free slot, reads and decodes an image into it and passes it on
+	- this thread enqueues the slot's pipeline on the device and passes it on
+	- the writer waits for the slot's output, writes it and gives the slot back to the reader
+	The slots go round through lock-free queues, so at most as many images as there are slots are
+	between reading and writing. A null slot marks the end of the batch, and any thread that fails
+	stops the others, its exception being rethrown here once they are joined.
+	*/
+	const size_t capacity = _slots.size() + 1;
+	SpscQueue<Slot*> free_slots(capacity), read_slots(capacity), enqueued_slots(capacity);
+	std::atomic<bool> stop(false);
+	std::exception_ptr read_error, enqueue_error, write_error;
+	size_t pixels = 0;
+
+	for (auto& slot: _slots) free_slots.try_push(&slot);
+
+	std::thread reader([&]() {
+		try {
+			std::vector<char> numbered_name(output_filename.size() + 32);
+			Slot* slot;
+
+			for (size_t index = 0; index < image_filenames.size(); ++index) {
+				if (!free_slots.pop(slot, stop)) return;
+
+				slot->index = index;
+				slot->output_name = cimg::number_filename(output_filename.c_str(), (i32)index, 6, numbered_name.data());
+				_read(*slot, image_filenames[index]);
+
+				if (!read_slots.push(slot, stop)) return;
+			}
+			read_slots.push(nullptr, stop);
+		}
+		catch (...) {
+			read_error = std::current_exception();
+			stop = true;
+		}
+	});
+
+	std::thread writer([&]() {
+		try {
+			Slot* slot;
 
-	while (!output_disp.is_keyESC() && !output_disp.is_closed()) output_disp.wait(1);
+			while (enqueued_slots.pop(slot, stop) && slot) {
+				_finish(*slot, true);
+				if (!free_slots.push(slot, stop)) return;
+			}
+		}
+		catch (...) {
+			write_error = std::current_exception();
+			stop = true;
+		}
+	});
+
+	try {
+		Slot* slot;
+
+		while (read_slots.pop(slot, stop)) {
+			if (slot) {
+				_enqueue(*slot);
+				pixels += slot->pixels;
+			}
+			if (!enqueued_slots.push(slot, stop) || !slot) break;
+		}
+	}
+	catch (...) {
+		enqueue_error = std::current_exception();
+		stop = true;
+	}
+
+	reader.join();
+	writer.join();
+
+	// a failure leaves the writer without waiting on the slots still queued for it, so every slot's
+	// queue is finished before their memory can be released
+	if (stop) _wait_all();
+
+	for (const auto& error: {read_error, enqueue_error, write_error})
+		if (error) std::rethrow_exception(error);
+
+	return pixels;
+}
+
+template<typename T>
+void HistFilter<T>::output(const std::vector<std::string>& image_filenames, const std::string& output_filename) {
+	/*
+	Given an output file name, nothing is displayed and the equalized images are written there instead,
+	numbered by image the way CImg does it when there are several. Such batches are pipelined over
+	threads, while images that are displayed are done one after another on this thread.
+	*/
+	cbool numbered = image_filenames.size() > 1;
+	const auto started = std::chrono::steady_clock::now();
+	const size_t pixels = (numbered && !output_filename.empty())?
+		_output_threaded(image_filenames, output_filename) : _output_serial(image_filenames, output_filename);
+
+	// the batch's throughput includes time spent waiting on displays, so it is only meaningful headless
+	if (numbered) {
+		const std::chrono::duration<f64> elapsed = std::chrono::steady_clock::now() - started;
+		std::cout
+			<< image_filenames.size() << " images in " << elapsed.count() << " s, "
+			<< image_filenames.size() / elapsed.count() << " images/s, "
+			<< pixels / elapsed.count() / 1e6 << " Mpixel/s\n";
+	}
 }
 
 auto main(i32 argc, str* argv) -> i32 {
@@ -391,37 +1683,49 @@ auto main(i32 argc, str* argv) -> i32 {
 	ci32 device_id   = 0;
 	const std::string path = relative_path();
 	// const std::string image_filename  = path + "images/test.ppm";
-	const std::string kernel_filename = path + "kernels/kernels.cl";
+	const std::string kernel_cache = cache_directory();
 
 	cimg::exception_mode(0);
 
 	try {
 		auto options = handle_args(argc, argv, platform_id, device_id);
 		if (options.help_mode) return EXIT_SUCCESS;
+
+		std::vector<std::string> image_filenames;
+		for (const auto& file_name: options.file_names)
+			image_filenames.push_back(image_path(path, file_name));
 		
 		switch (options.bits) {
 			case 8: {
 				HistFilter<u8> hist_filter(
-					path + "images/" + options.file_name,
-					kernel_filename,
+					kernel_cache,
 					platform_id,
 					device_id,
 					options.color_mode,
+					options.color_math,
+					options.layout,
+					options.in_flight,
+					options.stripe_rows,
+					options.large_images,
 					options.debug
 				);
-				hist_filter.output();
+				hist_filter.output(image_filenames, options.output_file_name);
 				break;
 			}
 			case 16: {
 				HistFilter<u16> hist_filter(
-					path + "images/" + options.file_name,
-					kernel_filename,
+					kernel_cache,
 					platform_id,
 					device_id,
 					options.color_mode,
+					options.color_math,
+					options.layout,
+					options.in_flight,
+					options.stripe_rows,
+					options.large_images,
 					options.debug
 				);
-				hist_filter.output();
+				hist_filter.output(image_filenames, options.output_file_name);
 				break;
 			}
 		}
@@ -438,6 +1742,10 @@ auto main(i32 argc, str* argv) -> i32 {
 		std::cerr << "CImg Error: " << err.what() << std::endl;
 		return EXIT_FAILURE;
 	}
+	catch (const std::runtime_error& err) {
+		std::cerr << "File Error: " << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -124,8 +124,7 @@ void CheckError(cl_int error) {
 void AddSources(cl::Program::Sources& sources, const string& file_name) {
 	//TODO: add file existence check
 	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
+	sources.push_back(string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>())));
 }
 
 string ListPlatformsDevices() {